@@ -0,0 +1,275 @@
+// Buddy allocator for physically contiguous runs of pages.
+//
+// Manages all of RAM from the end of the kernel to PHYSTOP as
+// free blocks of 2^order pages, order 0..NORDER-1, each aligned
+// (relative to KERNBASE) to its own size. Freeing a block merges
+// it with its buddy for as long as the buddy is also free.
+//
+// kalloc() takes single pages from here in batches to refill its
+// per-CPU lists; kallocpages() hands out larger blocks.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "memstat.h"
+
+// Free-list link, stored in the first page of a free block.
+struct bnode {
+  struct bnode *next;
+  struct bnode *prev;
+};
+
+struct {
+  struct spinlock lock;
+  struct bnode free[NORDER];  // circular list heads
+  uint64 nblocks[NORDER];     // number of free blocks per order
+  uint64 npages;              // pages managed
+  uint64 nfree;               // pages in free blocks
+  // order+1 for the first page of a free block, 0 otherwise.
+  uchar tag[MAXPAGES];
+} buddy;
+
+static void
+push(struct bnode *b, int order)
+{
+  struct bnode *h = &buddy.free[order];
+
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+  buddy.tag[PA2PG(b)] = order + 1;
+  buddy.nblocks[order]++;
+  buddy.nfree += 1L << order;
+}
+
+static void
+unlink(struct bnode *b, int order)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.tag[PA2PG(b)] = 0;
+  buddy.nblocks[order]--;
+  buddy.nfree -= 1L << order;
+}
+
+// Caller holds buddy.lock.
+static void*
+balloc(int order)
+{
+  struct bnode *b;
+  int k;
+
+  for(k = order; k < NORDER; k++)
+    if(buddy.free[k].next != &buddy.free[k])
+      break;
+  if(k == NORDER)
+    return 0;
+
+  b = buddy.free[k].next;
+  unlink(b, k);
+  // split, returning the upper halves to the free lists.
+  while(k > order){
+    k--;
+    push((struct bnode*)((char*)b + (PGSIZE << k)), k);
+  }
+  return b;
+}
+
+// Caller holds buddy.lock.
+static void
+bfree(void *pa, int order)
+{
+  uint64 pg = PA2PG(pa);
+
+  while(order < NORDER-1){
+    uint64 bpg = pg ^ (1L << order);
+    if(bpg >= MAXPAGES || buddy.tag[bpg] != order + 1)
+      break;
+    unlink((struct bnode*)PG2PA(bpg), order);
+    pg &= ~(1L << order);
+    order++;
+  }
+  push((struct bnode*)PG2PA(pg), order);
+}
+
+// Hand the pages from pa_start to pa_end to the allocator,
+// in the largest aligned blocks that fit.
+void
+buddyinit(void *pa_start, void *pa_end)
+{
+  uint64 pa, pg;
+  int k;
+
+  initlock(&buddy.lock, "buddy");
+  for(k = 0; k < NORDER; k++)
+    buddy.free[k].next = buddy.free[k].prev = &buddy.free[k];
+
+  pa = PGROUNDUP((uint64)pa_start);
+  while(pa + PGSIZE <= (uint64)pa_end){
+    pg = PA2PG(pa);
+    for(k = NORDER-1; k > 0; k--)
+      if((pg & ((1L << k) - 1)) == 0 && pa + (PGSIZE << k) <= (uint64)pa_end)
+        break;
+    bfree((void*)pa, k);
+    buddy.npages += 1L << k;
+    pa += PGSIZE << k;
+  }
+}
+
+// Allocate a block of 2^order contiguous pages.
+// Returns 0 if no block that large is free.
+void*
+buddyalloc(int order)
+{
+  void *pa;
+
+  if(order < 0 || order >= NORDER)
+    return 0;
+  acquire(&buddy.lock);
+  pa = balloc(order);
+  release(&buddy.lock);
+  return pa;
+}
+
+// Free a block allocated with buddyalloc(order).
+void
+buddyfree(void *pa, int order)
+{
+  if(order < 0 || order >= NORDER || PA2PG(pa) % (1L << order) != 0)
+    panic("buddyfree");
+  acquire(&buddy.lock);
+  bfree(pa, order);
+  release(&buddy.lock);
+}
+
+// Allocate up to n single pages under one acquisition
+// of the lock. Returns the number allocated.
+int
+buddyallocbatch(void **pa, int n)
+{
+  int i;
+
+  acquire(&buddy.lock);
+  for(i = 0; i < n; i++)
+    if((pa[i] = balloc(0)) == 0)
+      break;
+  release(&buddy.lock);
+  return i;
+}
+
+// Free n single pages under one acquisition of the lock.
+void
+buddyfreebatch(void **pa, int n)
+{
+  acquire(&buddy.lock);
+  for(int i = 0; i < n; i++)
+    bfree(pa[i], 0);
+  release(&buddy.lock);
+}
+
+// Return the number of free pages. Read without the lock,
+// for a cheap estimate.
+uint64
+buddynfree(void)
+{
+  return buddy.nfree;
+}
+
+// Fill in the buddy part of st.
+void
+buddystat(struct memstat *st)
+{
+  acquire(&buddy.lock);
+  st->npages = buddy.npages;
+  for(int k = 0; k < NORDER; k++){
+    st->nblocks[k] = buddy.nblocks[k];
+    st->nfree += buddy.nblocks[k] << k;
+  }
+  release(&buddy.lock);
+}
+
+#ifdef KTEST
+// Walk the free lists, checking each block's tag and alignment,
+// and count what they hold against nblocks[] and nfree, and
+// against the tags of all of memory. Caller holds buddy.lock.
+// Returns 0 if all agree, -1 otherwise.
+static int
+bcheck(void)
+{
+  struct bnode *b;
+  uint64 n, pages = 0, blocks = 0, tagged = 0;
+  int k;
+
+  for(k = 0; k < NORDER; k++){
+    n = 0;
+    for(b = buddy.free[k].next; b != &buddy.free[k]; b = b->next){
+      if(buddy.tag[PA2PG(b)] != k + 1 || PA2PG(b) % (1L << k) != 0)
+        return -1;
+      n++;
+    }
+    if(n != buddy.nblocks[k])
+      return -1;
+    blocks += n;
+    pages += n << k;
+  }
+  for(n = 0; n < MAXPAGES; n++)
+    if(buddy.tag[n])
+      tagged++;
+  return pages == buddy.nfree && tagged == blocks ? 0 : -1;
+}
+
+// Allocate and free n blocks of mixed orders, checking that
+// every block is aligned to its size and that no two live
+// blocks overlap, then check the free lists (bcheck()).
+// Returns 0 if all is well, -1 otherwise. For the buddystress
+// test in usertests, in kernels built with make KTEST=1.
+int
+buddytest(int seed, int n)
+{
+  enum { NSLOT = 32, MAXTEST = 6 };
+  struct { uint64 *pa; int order; int id; } slot[NSLOT];
+  uint64 x = seed;
+  int i, j, s, err = 0;
+
+  memset(slot, 0, sizeof(slot));
+  for(i = 0; i < n && !err; i++){
+    x = x * 6364136223846793005UL + 1442695040888963407UL;
+    s = (x >> 33) % NSLOT;
+    if(slot[s].pa == 0){
+      int order = (x >> 40) % (MAXTEST+1);
+      uint64 *pa = kallocpages(order);
+      if(pa == 0)
+        continue;
+      if(PA2PG(pa) % (1L << order) != 0)
+        err = 1;
+      // stamp every page with its address and the allocation
+      // number, so an overlapping block would overwrite it.
+      for(j = 0; j < (1 << order); j++)
+        *(uint64*)((char*)pa + j*PGSIZE) = (uint64)pa + j*PGSIZE + i;
+      slot[s].pa = pa;
+      slot[s].order = order;
+      slot[s].id = i;
+    } else {
+      for(j = 0; j < (1 << slot[s].order); j++){
+        uint64 *w = (uint64*)((char*)slot[s].pa + j*PGSIZE);
+        if(*w != (uint64)w + slot[s].id)
+          err = 1;
+      }
+      kfreepages(slot[s].pa, slot[s].order);
+      slot[s].pa = 0;
+    }
+  }
+  for(s = 0; s < NSLOT; s++)
+    if(slot[s].pa)
+      kfreepages(slot[s].pa, slot[s].order);
+  acquire(&buddy.lock);
+  if(bcheck() < 0)
+    err = 1;
+  release(&buddy.lock);
+  return err ? -1 : 0;
+}
+#endif
@@ -109,8 +109,11 @@ consoleread(int user_dst, uint64 dst, int n)
 
     // copy the input byte to the user-space buffer.
     cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
+    if(either_copyout(user_dst, dst, &cbuf, 1) == -1){
+      // leave it for the read that retries.
+      cons.r--;
       break;
+    }
 
     dst++;
     --n;
@@ -2,13 +2,27 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct memstat;
 struct pipe;
 struct proc;
+struct slabcache;
+struct spawnact;
+struct seg;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
 
+// buddy.c
+void            buddyinit(void*, void*);
+void*           buddyalloc(int);
+void            buddyfree(void*, int);
+int             buddyallocbatch(void**, int);
+void            buddyfreebatch(void**, int);
+uint64          buddynfree(void);
+void            buddystat(struct memstat*);
+int             buddytest(int, int);
+
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
@@ -24,19 +38,57 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execinto(struct proc*, char*, char**);
+struct seg*     findseg(struct proc*, uint64);
+int             segfault(struct proc*, struct seg*, uint64, int);
+void            segtrim(struct proc*, uint64);
 
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            vmalistinit(void);
-struct vma*     checkaddr(void* addr);
+struct vma*     vmaalloc(void);
+void            vmafree(struct vma*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
 void *          mmap(void *addr, uint64 length, int prot, int flag, int fd, int offset);
 int             munmap(void *addr, uint64 length);
+int             mmapfault(struct proc*, uint64, int);
+int             msync(uint64, uint64, int);
+void            writeback(void);
+int             madvise(uint64, uint64, int);
+int             mprotect(uint64, uint64, int);
+int             mlock(uint64, uint64, int);
+void            readahead(void);
+int             vmreclaim(struct proc*, int);
+
+// vma.c
+struct vma*     vmalookup(struct proc*, uint64);
+struct vma*     vmafirst(struct proc*);
+struct vma*     vmanext(struct proc*, struct vma*);
+uint64          vmaplace(struct proc*, uint64);
+void            vmainsert(struct proc*, struct vma*);
+void            vmaremove(struct proc*, struct vma*);
+void            vmaresize(struct proc*, struct vma*, uint64, uint64);
+struct vma*     vmasplit(struct proc*, struct vma*, uint64);
+struct vma*     vmaclip(struct proc*, struct vma*, uint64, uint64);
+struct vma*     vmaoverlap(struct proc*, uint64, uint64);
+int             vmacovers(struct proc*, uint64, uint64);
+
+// reclaim.c
+void            reclaimer(void);
+void            reclaimself(struct proc*);
+int             reclaimfault(struct proc*, uint64, int);
+void            reclaimstat(struct memstat*);
+
+// ksm.c
+void            ksminit(void);
+void            ksmscanner(void);
+void            ksmself(struct proc*);
+void            ksmstat(struct memstat*);
 
 // fs.c
 void            fsinit(int);
@@ -67,6 +119,20 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            incref(void *);
+int             decref(void *);
+void            putref(void *);
+int             getref(void *);
+void            kdrain(void);
+void*           kallocpages(int);
+void            kfreepages(void *, int);
+void            kmemstat(struct memstat*);
+void*           kalloc_zeroed(void);
+void            kzeroidle(void);
+void*           zeropage(void);
+uint64          knfree(void);
+int             kmemlow(void);
+uint            kallocfails(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -74,7 +140,18 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// pcache.c
+void            pcinit(void);
+void*           pcread(struct inode*, uint);
+int             pcreadi(struct inode*, int, uint64, uint, uint);
+void            pcupdate(struct inode*, uint, void*, uint);
+void            pcinval(struct inode*);
+int             pcreap(void);
+void*           pcpeek(struct inode*, uint);
+void            pcstat(struct memstat*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -89,6 +166,10 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             vfork(void);
+void            vforkdone(struct proc*);
+int             spawn(char*, char**, struct spawnact*, int);
+void            kthread(void (*)(void), char*);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
@@ -111,9 +192,40 @@ int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 
+// swap.c
+void            swapinit(struct superblock*);
+int             swapalloc(char*);
+void            swapwrite(int);
+void            swapsync(void);
+void            swapdup(int);
+void            swapfree(int);
+int             swapin(pte_t*);
+void            swapstat(struct memstat*);
+
+// zram.c
+void            zraminit(void);
+void*           zramstore(char*);
+void            zramload(void*, char*);
+void            zramfree(void*);
+void            zramstat(struct memstat*);
+
+// lz.c
+int             lzcompress(uchar*, int, uchar*, int);
+int             lzdecompress(uchar*, int, uchar*, int);
+
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// slab.c
+void            slabinit(void);
+struct slabcache* slabcreate(char*, uint);
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+int             slabreap(void);
+void*           kmalloc(uint);
+void            kmfree(void*);
+void            slabstat(struct memstat*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -169,6 +281,14 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             vmfault(struct proc*, uint64, int);
+void            uvmprefault(uint64, uint64, int);
+int             copyfault(int);
+void            uvmborrow(pagetable_t, pagetable_t);
+void            uvmunborrow(pagetable_t, pagetable_t);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -188,6 +308,7 @@ void            plic_complete(int);
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
 void            virtio_disk_intr(void);
+void            virtio_disk_page(char*, uint, int, void (*)(char*, uint));
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -6,6 +6,7 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "vma.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
@@ -21,15 +22,31 @@ int flags2perm(int flags)
 
 int
 exec(char *path, char **argv)
+{
+  return execinto(myproc(), path, argv);
+}
+
+// Load the program at path, with arguments argv, into a new
+// address space for p and switch p to it. p is either the
+// current process or a new child that has not run yet (see
+// spawn()). Returns argc, or -1 leaving p unchanged.
+//
+// Only the stack is filled in here. The program's segments
+// are recorded in p->segs and their pages read from the file
+// by segfault() when first touched; pages past the file data
+// (the BSS) are demand-zero like the heap.
+int
+execinto(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
-  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  int i, off, nseg = 0;
+  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase, oldsz;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct seg seg[NSEG];
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+  struct vma *v;
 
   begin_op();
 
@@ -61,20 +78,30 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
-      goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    // a page may belong to only one segment.
+    if(ph.vaddr < PGROUNDUP(sz))
       goto bad;
+    if(ph.filesz > 0 && nseg < NSEG){
+      seg[nseg].va = ph.vaddr;
+      seg[nseg].filesz = ph.filesz;
+      seg[nseg].off = ph.off;
+      seg[nseg].perm = flags2perm(ph.flags);
+      nseg++;
+    } else if(ph.filesz > 0){
+      // too many segments to track: load this one now.
+      if(uvmalloc(pagetable, ph.vaddr, ph.vaddr + ph.memsz, flags2perm(ph.flags)) == 0)
+        goto bad;
+      if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+        goto bad;
+    }
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // keep a reference to the file, for segfault().
+  iunlock(ip);
   end_op();
+  exe = ip;
   ip = 0;
 
-  p = myproc();
-  uint64 oldsz = p->sz;
-
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
   // Use the second as the user stack.
@@ -121,12 +148,26 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  while((v = vmafirst(p)) != 0)
+    munmap((void*)v->vm_start, v->vm_end - v->vm_start);
+  if(p->vfparent)
+    vforkdone(p);
   oldpagetable = p->pagetable;
+  oldsz = p->sz;
+  oldexe = p->exe;
   p->pagetable = pagetable;
   p->sz = sz;
+  p->exe = exe;
+  memmove(p->segs, seg, sizeof(seg));
+  p->nseg = nseg;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -137,9 +178,104 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    begin_op();
+    iput(exe);
+    end_op();
+  }
   return -1;
 }
 
+// Return the segment of p's program holding file data in
+// the page at va, or 0 if the page is not backed by the file.
+struct seg*
+findseg(struct proc *p, uint64 va)
+{
+  struct seg *s;
+
+  va = PGROUNDDOWN(va);
+  for(s = p->segs; s < p->segs + p->nseg; s++)
+    if(va >= s->va && va < s->va + s->filesz)
+      return s;
+  return 0;
+}
+
+// Read the page at va of p's program, from segment s, on
+// its first touch, and map it. Whole pages of the file come
+// from the page cache, shared with every other process running
+// the program: as they are for read-only segments, and
+// copy-on-write for writable ones. Returns 0, or -1 if the
+// access is not allowed or the page cannot be read.
+int
+segfault(struct proc *p, struct seg *s, uint64 va, int write)
+{
+  char *mem;
+  uint n, off;
+  int perm;
+
+  if(write && (s->perm & PTE_W) == 0)
+    return -1;
+  va = PGROUNDDOWN(va);
+  n = PGSIZE;
+  if(s->va + s->filesz - va < n)
+    n = s->va + s->filesz - va;
+  off = s->off + (va - s->va);
+
+  if(n == PGSIZE && off % PGSIZE == 0){
+    ilock(p->exe);
+    mem = pcread(p->exe, off);
+    iunlock(p->exe);
+    if(mem == 0)
+      return -1;
+    perm = s->perm;
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+    if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm | PTE_R | PTE_U) != 0){
+      putref(mem);
+      return -1;
+    }
+    // a store to a writable segment copies the page now.
+    if(write)
+      return uvmcow(p->pagetable, va);
+    return 0;
+  }
+
+  // the last, partial page of a segment: zero past the data.
+  if((mem = kalloc()) == 0)
+    return -1;
+  if(n < PGSIZE)
+    memset(mem + n, 0, PGSIZE - n);
+  ilock(p->exe);
+  if(pcreadi(p->exe, 0, (uint64)mem, off, n) != n){
+    iunlock(p->exe);
+    kfree(mem);
+    return -1;
+  }
+  iunlock(p->exe);
+
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, s->perm | PTE_R | PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// p's memory has shrunk to sz: forget the file data of any
+// segment above it, so that pages the heap later grows back
+// into start out zero.
+void
+segtrim(struct proc *p, uint64 sz)
+{
+  struct seg *s;
+
+  for(s = p->segs; s < p->segs + p->nseg; s++){
+    if(s->va >= sz)
+      s->filesz = 0;
+    else if(s->va + s->filesz > sz)
+      s->filesz = sz - s->va;
+  }
+}
+
 // Load a program segment into pagetable at virtual address va.
 // va must be page-aligned
 // and the pages from va to va+sz must already be mapped.
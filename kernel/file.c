@@ -16,24 +16,36 @@
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock;    // protects every file's ref
+  struct slabcache *cache;
 } ftable;
 
-// Struct to create a lock for vmalist
-struct {
+// vmas are allocated from a slab cache
+struct slabcache *vmacache;
+
+// MADV_WILLNEED requests, for the readahead thread.
+#define NRA 16
+static struct {
   struct spinlock lock;
-  struct vma vmas[VMA_MAX];
-} vma_list;
+  struct {
+    struct inode *ip;
+    uint off;
+    uint npages;
+  } q[NRA];
+  uint r;  // requests taken
+  uint w;  // requests queued
+} ra;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = slabcreate("file", sizeof(struct file));
 }
 void vmalistinit(void)
 {
-  initlock(&vma_list.lock, "vma_list");
+  vmacache = slabcreate("vma", sizeof(struct vma));
+  initlock(&ra.lock, "readahead");
 }
 
 // Allocate a file structure.
@@ -42,16 +54,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = slaballoc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -80,9 +87,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  slabfree(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -122,6 +128,8 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  uvmprefault(addr, n, 1);
+again:
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -130,13 +138,22 @@ fileread(struct file *f, uint64 addr, int n)
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if(f->ip->type == T_FILE)
+      r = pcreadi(f->ip, 1, addr, f->off, n);
+    else
+      r = readi(f->ip, 1, addr, f->off, n);
+    if(r > 0)
       f->off += r;
     iunlock(f->ip);
   } else {
     panic("fileread");
   }
 
+  // the copy, made with a lock held, may have stopped at a
+  // page it could not fault in: fault it now and read again.
+  if(r <= 0 && copyfault(1) == 0)
+    goto again;
+
   return r;
 }
 
@@ -150,12 +167,27 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  uvmprefault(addr, n, 0);
+  // a copy made with a lock held may stop short at a page it
+  // could not fault in (see copyfault()): write the rest.
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    while((r = pipewrite(f->pipe, addr + ret, n - ret)) >= 0){
+      ret += r;
+      if(ret == n || copyfault(0) < 0)
+        break;
+    }
+    if(r < 0)
+      ret = -1;
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    while((r = devsw[f->major].write(1, addr + ret, n - ret)) >= 0){
+      ret += r;
+      if(ret == n || copyfault(0) < 0)
+        break;
+    }
+    if(r < 0)
+      ret = -1;
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
@@ -177,7 +209,7 @@ filewrite(struct file *f, uint64 addr, int n)
       iunlock(f->ip);
       end_op();
 
-      if(r != n1){
+      if(r < 0 || (r != n1 && copyfault(0) < 0)){
         // error from writei
         break;
       }
@@ -191,264 +223,1016 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Allocate a zeroed vma.
 struct vma*
 vmaalloc(void)
 {
   struct vma *v;
 
-  acquire(&vma_list.lock);
-  for(v = vma_list.vmas; v < vma_list.vmas + VMA_MAX; v++){
-    if(v->vm_ref == 0){
-      v->vm_ref = 1;
-      release(&vma_list.lock);
-      return v;
-    }
-  }
-  release(&vma_list.lock);
-  return 0;
+  if((v = slaballoc(vmacache)) == 0)
+    return 0;
+  memset(v, 0, sizeof(*v));
+  return v;
 }
 
-
-struct vma*
-getFreeVMA()
+void
+vmafree(struct vma *v)
 {
-  //buscar una vma libre
-  acquire(&vma_list.lock);
-  for(int i = 0;i<VMA_MAX;i++)
-  {
-    if(vma_list.vmas[i].use == 0)
-    {
-      vma_list.vmas[i].use = 1;
-      release(&vma_list.lock);
-      //printf("vma dada: %p\n",&vma_list.vmas[i]);
-      return &vma_list.vmas[i]; 
-    }
-  }
-  release(&vma_list.lock);
-  return (struct vma *) 0;
+  slabfree(vmacache, v);
 }
 
+static int vmapopulate(struct proc*, uint64, uint64);
+
 void*
 mmap(void *addr, uint64 length, int prot, int flag, int fd, int offset)
 {
-
-  //test
-  //printf("entra a mmap \n");
-  //printf("addr: %d, leng: %d, prot: %d, flag: %d, fd: %d, off: %d\n\n",addr,length,prot,flag,fd,offset);
-
   //obtencion del proceso actual
   struct proc *p = myproc();
 
+  //MAP_POPULATE no se guarda en la vma
+  int populate = flag & MAP_POPULATE;
+  flag &= ~MAP_POPULATE;
+
+  // la memoria de un hijo de vfork() es la del padre
+  if(p->vfparent)
+    return MAP_FAILED;
+
+  //una vma anonima no tiene fichero
+  struct file *file = 0;
+  if(!(flag & MAP_ANONYMOUS)){
+    //el fichero tiene que estar abierto y el offset alineado a pagina
+    if(p->ofile[fd] == 0 || p->ofile[fd]->type != FD_INODE)
+      return MAP_FAILED;
+    if(offset < 0 || offset % PGSIZE != 0)
+      return MAP_FAILED;
+    file = p->ofile[fd];
+  } else {
+    offset = 0;
+  }
+
   //comprobar flags:
   if (flag & MAP_SHARED) {
-    if ( !(p->ofile[fd]->writable) && (prot & PROT_WRITE) ) {
-      printf("fichero solo lectura, mmap con permisos de escritura\n");
+    if ( !(p->ofile[fd]->writable) && (prot & PROT_WRITE) )
       return MAP_FAILED;
-    }
   }
   
-  //comprobar si hay vma libre para el proceso;
-  acquire(&p->lock);
-  if(p->numVmas == VMA_PROCESS){
-    release(&p->lock);
-    printf("no hay vma libre para este proceso\n");
+  if(length == 0 || length > TOP_ADDRESS - START_ADDRESS)
     return MAP_FAILED;
-  }
 
   //declaracion de variables aux
   uint64 p_size;
+  uint64 start;
   struct vma *vma;
-  struct vma *actual;
-  struct vma *anterior;
 
-  //redondeo de la memoria y actualizar variables aux;
+  //redondeo de la memoria
   p_size = PGROUNDUP(length);
-  vma = 0; //0 es que no hay vma
-  actual = p->vmas;
-  anterior = 0; //inicialmente no hay vma anteriores
-
-  //recoriendo las vmas de los procesos
-  int i = 0;
-  for(i=0;i<=VMA_PROCESS;i++)
-  {
-    //el proceso no tiene vmas asociadas
-    if(actual==0)
-    {
-      //si hay una vma anterior y esta en una posicion no valida
-      if(((anterior != 0) && (anterior->vm_end + p_size) > TOP_ADDRESS) || ((anterior == 0) && START_ADDRESS + p_size > TOP_ADDRESS)){
-        printf("posicion no valida\n");
-        return MAP_FAILED;
-      }
 
-      //no quedan vmas libres globales
-      if((vma = getFreeVMA()) == (struct vma *) 0){
-        release(&p->lock);
-        printf("no hay vma libre en globla\n");
-        return MAP_FAILED;
-      }
+  //el hueco mas bajo donde cabe la vma (ver vma.c)
+  acquire(&p->lock);
+  if((start = vmaplace(p, p_size)) == 0){
+    release(&p->lock);
+    return MAP_FAILED;
+  }
+
+  //no quedan vmas libres globales
+  if((vma = vmaalloc()) == 0){
+    release(&p->lock);
+    return MAP_FAILED;
+  }
+  vma->vm_start = start;
+  vma->vm_end = start + p_size;
+  vma->vm_prot = prot;
+  vma->vm_file = file;
+  vma->vm_flags = flag;
+  vma->vm_firstDir = vma->vm_start;
+  vma->vm_offset = offset;
+
+  if(file)
+    filedup(file);
+  vmainsert(p, vma);
 
-      if(anterior == 0){
-        vma->vm_start = START_ADDRESS;
-        vma->vm_end = START_ADDRESS + p_size;
-      }else{
-        anterior->vm_next = vma;
-        vma->vm_start = anterior->vm_end;
-        vma->vm_end =  anterior->vm_end + p_size;
+  release(&p->lock);
+
+  //si no se puede mapear todo, el resto queda para los fallos
+  if(populate)
+    vmapopulate(p, start, start + p_size);
+  return (void *)start;  
+
+}
+
+// File offset of the page of v at va. vm_firstDir stays
+// where the mapping began even if its front is unmapped.
+static uint
+vmaoff(struct vma *v, uint64 va)
+{
+  return v->vm_offset + (va - v->vm_firstDir);
+}
+
+// A MADV_SEQUENTIAL scan of v has faulted at va: unmap the
+// window of pages it passed before the previous one, so that
+// the pages go back to the page cache's LRU instead of staying
+// until munmap(). Only pages that are the cached page itself
+// and clean are dropped; a later touch faults them in again.
+static void
+dropbehind(struct proc *p, struct vma *v, uint64 va)
+{
+  uint64 a, start, end;
+  pte_t *pte;
+
+  if(v->vm_file == 0 || va < v->vm_start + FAULTAROUND*PGSIZE)
+    return;
+  end = va - FAULTAROUND*PGSIZE;
+  start = v->vm_start;
+  if(end - start > FAULTAROUND*PGSIZE)
+    start = end - FAULTAROUND*PGSIZE;
+  for(a = start; a < end; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0)
+      continue;
+    // a private copy, or stores not yet written back.
+    if(pcpeek(v->vm_file->ip, vmaoff(v, a)) != (void*)PTE2PA(*pte))
+      continue;
+    if(v->vm_flags == MAP_SHARED && (*pte & PTE_D))
+      continue;
+    uvmunmap(p->pagetable, a, 1, 1);
+  }
+}
+
+// Give p the page of a mapped file that contains va, from
+// the page cache: MAP_SHARED mappings map the cached page
+// itself, MAP_PRIVATE ones map it copy-on-write. write is
+// non-zero for a store.
+//
+// The fault also maps the following pages of the file that
+// are not mapped yet (fault-around). The window starts at one
+// page and doubles, up to FAULTAROUND, each time a fault lands
+// just past the previous window, so a sequential scan takes
+// few faults and one ilock() per window.
+// Returns 0 on success, -1 if va is not in a mapping, the
+// access is not allowed, or memory is exhausted.
+int
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  // ver que vma tiene el proceso, si la direccion esta dentro de alguno de los vma del proceso entonces le damos una pagina al proceso.
+  // si no esta dentro de ninguno de los vma del proceso entonces se mata el proceso.
+  // el tamaño del proceso no se toca, solo se le da una pagina al proceso.
+
+  uint64 addr = PGROUNDDOWN(va); //direcion causante
+  int i;
+
+  //buscamos la vma que ha generando el fallo
+  struct vma *actual = vmalookup(p, addr);
+
+  //la direccion no esta en ninguna vma
+  if(actual == 0)
+    return -1;
+
+  //la pagina ya esta: the access itself is not allowed
+  pte_t *pte = walk(p->pagetable, addr, 0);
+  if(pte && (*pte & PTE_V))
+    return -1;
+
+  //escribir sin PROT_WRITE no esta permitido, ni nada con PROT_NONE
+  if(write && (actual->vm_prot & PROT_WRITE) == 0)
+    return -1;
+  if(actual->vm_prot == PROT_NONE)
+    return -1;
+
+  //una pagina escribible tambien se puede leer
+  int perm = actual->vm_prot | PTE_R | PTE_U;
+
+  //anonima: una lectura mapea la pagina cero, y la primera
+  //escritura pide una pagina a cero (ver uvmcow())
+  if(actual->vm_flags & MAP_ANONYMOUS){
+    char *mem;
+    if(!write){
+      mem = zeropage();
+      if(perm & PTE_W)
+        perm = (perm & ~PTE_W) | PTE_COW;
+      if(mappages(p->pagetable, addr, PGSIZE, (uint64)mem, perm) != 0)
+        return -1;
+      incref(mem);
+      return 0;
+    }
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+    if(mappages(p->pagetable, addr, PGSIZE, (uint64)mem, perm) != 0){
+      kfree(mem);
+      return -1;
+    }
+    return 0;
+  }
+  if((perm & PTE_W) && actual->vm_flags == MAP_PRIVATE)
+    perm = (perm & ~PTE_W) | PTE_COW;
+
+  //tamaño de la ventana: crece con los fallos secuenciales,
+  //salvo que madvise() diga como se va a recorrer
+  if(actual->vm_advice == MADV_RANDOM){
+    actual->vm_window = 1;
+  } else if(actual->vm_advice == MADV_SEQUENTIAL){
+    actual->vm_window = FAULTAROUND;
+    if(!actual->vm_locked)
+      dropbehind(p, actual, addr);
+  } else if(addr == actual->vm_nextfault){
+    if(actual->vm_window < FAULTAROUND)
+      actual->vm_window *= 2;
+  } else {
+    actual->vm_window = 1;
+  }
+
+  //las paginas de la cache, con una referencia para nosotros
+  struct inode *ip = actual->vm_file->ip;
+  uint64 a = addr;
+  ilock(ip);
+  for(i = 0; i < actual->vm_window && a < actual->vm_end; i++, a += PGSIZE){
+    if(a != addr){
+      //las vecinas solo si estan en el fichero y sin mapear
+      if(vmaoff(actual, a) >= ip->size)
+        break;
+      pte = walk(p->pagetable, a, 0);
+      if(pte && (*pte & (PTE_V|PTE_SWAP)))
+        continue;
+    }
+    char *pgAddr = pcread(ip, vmaoff(actual, a));
+    if(pgAddr == 0)
+      break;
+    if(mappages(p->pagetable, a, PGSIZE, (uint64)pgAddr, perm) != 0){
+      putref(pgAddr);
+      break;
+    }
+  }
+  iunlock(ip);
+  actual->vm_nextfault = a;
+
+  //no se pudo mapear ni la pagina del fallo
+  if(a == addr)
+    return -1;
+
+  //MAP_PRIVATE: la escritura se hace sobre una copia
+  if(write && (perm & PTE_COW))
+    return uvmcow(p->pagetable, addr);
+  return 0;
+}
+
+// A dirty page of a MAP_SHARED mapping on its way to disk.
+// It holds a reference to the page and to the inode, so that
+// the write may happen after the mapping is gone.
+struct wbpage {
+  struct inode *ip;
+  uint off;
+  char *pa;
+};
+
+// pages one transaction may write: each is PGSIZE/BSIZE
+// blocks, besides the inode and the indirect block.
+#define WBTXPAGES ((MAXOPBLOCKS-2) / (PGSIZE/BSIZE))
+
+extern struct proc proc[NPROC];
+
+// set by msync(MS_ASYNC) to start a writeback pass now.
+static int wbkick;
+
+// Collect the dirty pages of v from *start up to end, at most
+// max of them, into wb, clearing their dirty bits; *start is
+// advanced past the last page looked at. Returns the number
+// collected. p->lock must be held, which keeps the vma and
+// the page table in place.
+static int
+wbcollect(struct proc *p, struct vma *v, uint64 *start, uint64 end,
+          struct wbpage *wb, int max)
+{
+  pte_t *pte;
+  uint64 a, old;
+  int n = 0;
+
+  if(v->vm_flags != MAP_SHARED)
+    return 0;
+  for(a = *start; a < end && n < max; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    // the hardware may be setting bits in the pte at the same
+    // time; only one of two collectors gets the page.
+    old = __sync_fetch_and_and(pte, ~PTE_D);
+    if((old & PTE_D) == 0)
+      continue;
+    wb[n].ip = idup(v->vm_file->ip);
+    wb[n].off = vmaoff(v, a);
+    wb[n].pa = (char*)PTE2PA(old);
+    incref(wb[n].pa);
+    n++;
+  }
+  *start = a;
+  return n;
+}
+
+// Write the n pages of wb to their files and drop the
+// references wbcollect() took. Runs of pages at consecutive
+// offsets of one file share a transaction and an ilock(), up
+// to WBTXPAGES pages, which keeps every transaction within
+// the log's limit. Only the bytes inside the file are written.
+// Returns 0, or -1 if a write failed.
+static int
+wbwrite(struct wbpage *wb, int n)
+{
+  struct inode *ip;
+  uint len;
+  int i, j, k, r = 0;
+
+  for(i = 0; i < n; i = j){
+    ip = wb[i].ip;
+    for(j = i + 1; j < n && j - i < WBTXPAGES; j++)
+      if(wb[j].ip != ip || wb[j].off != wb[j-1].off + PGSIZE)
+        break;
+
+    begin_op();
+    ilock(ip);
+    for(k = i; k < j && wb[k].off < ip->size; k++){
+      len = ip->size - wb[k].off;
+      if(len > PGSIZE)
+        len = PGSIZE;
+      if(writei(ip, 0, (uint64)wb[k].pa, wb[k].off, len) != len){
+        printf("writeback: write failed\n");
+        r = -1;
+        break;
       }
-      vma->vm_next = 0;
-      goto alloc;
+    }
+    iunlock(ip);
+    for(k = i; k < j; k++)
+      iput(wb[k].ip);
+    end_op();
+    for(k = i; k < j; k++)
+      putref(wb[k].pa);
+  }
+  return r;
+}
 
-    }else if((anterior != 0) && anterior->vm_end + p_size <= actual->vm_start){ //hay una vma anterior y valid
-      
-      //buscar una vma libre
-      if((vma = getFreeVMA()) == (struct vma *) 0){
-        release(&p->lock);
-        printf("no hay vma libre en gobla v2\n");
-        return MAP_FAILED;
+// Pages one writeback pass has collected, a kalloc()ed page
+// of them at a time.
+struct wbchunk {
+  struct wbchunk *next;
+  int n;
+  struct wbpage wb[];
+};
+
+#define WBCHUNK ((PGSIZE - sizeof(struct wbchunk)) / sizeof(struct wbpage))
+
+// One pass of the writeback thread over every process's
+// shared mappings: collect all their dirty pages, then wait
+// once for the TLBs, then write the pages. If memory runs out
+// the pages not collected are left for the next pass.
+static void
+wbpass(void)
+{
+  struct wbchunk *head = 0, *c = 0, *spare = 0;
+  struct proc *p;
+  struct vma *v;
+  uint64 a;
+  uint t0;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+again:
+    // chunks are allocated without p->lock held.
+    if(spare == 0 && (spare = kalloc()) == 0)
+      break;
+    acquire(&p->lock);
+    for(v = vmafirst(p); v; v = vmanext(p, v)){
+      if(v->vm_flags != MAP_SHARED)
+        continue;
+      for(a = v->vm_start; a < v->vm_end; ){
+        if(c == 0 || c->n == WBCHUNK){
+          if(spare == 0){
+            // look at p again once there is another chunk;
+            // the pages collected are clean, so are not
+            // collected twice.
+            release(&p->lock);
+            goto again;
+          }
+          spare->next = head;
+          spare->n = 0;
+          head = c = spare;
+          spare = 0;
+        }
+        c->n += wbcollect(p, v, &a, v->vm_end, c->wb + c->n, WBCHUNK - c->n);
       }
-      
-      //si hay una libre, actualizamos las variables del bucle y vamos a la parte de alloc
-      anterior->vm_next = vma;
-      vma->vm_start = anterior->vm_end;
-      vma->vm_end = anterior->vm_end + p_size;
-      vma->vm_next = actual;
-      goto alloc;
+    }
+    release(&p->lock);
+  }
+  if(spare)
+    kfree(spare);
+  if(head == 0)
+    return;
+
+  // a CPU running one of these processes may still hold a
+  // TLB entry with the dirty bit set, and stores through it
+  // would not set the bit in the pte again. Every CPU takes
+  // a timer interrupt within a tick, and the return to user
+  // space flushes its TLB, so after two ticks every later
+  // store either is in the page we write or sets the bit.
+  acquire(&tickslock);
+  t0 = ticks;
+  while(ticks - t0 < 2)
+    sleep(&ticks, &tickslock);
+  release(&tickslock);
+
+  while((c = head) != 0){
+    head = c->next;
+    wbwrite(c->wb, c->n);
+    kfree(c);
+  }
+}
+
+// Body of the writeback kernel thread: every WBTICKS ticks,
+// or sooner after msync(MS_ASYNC), write the pages dirtied
+// in shared mappings back to their files and clear their
+// dirty bits, so that munmap() only writes pages dirtied
+// since the last pass.
+void
+writeback(void)
+{
+  uint t0;
+
+  for(;;){
+    acquire(&tickslock);
+    t0 = ticks;
+    while(ticks - t0 < WBTICKS && !wbkick)
+      sleep(&ticks, &tickslock);
+    wbkick = 0;
+    release(&tickslock);
+    wbpass();
+  }
+}
+
+// Write the dirty pages of the mappings in [addr, addr+length)
+// back to their files: now with MS_SYNC, or by the writeback
+// thread soon with MS_ASYNC. Returns 0, or -1 if part of the
+// range is not mapped or a write failed.
+int
+msync(uint64 addr, uint64 length, int flags)
+{
+  struct proc *p = myproc();
+  struct wbpage wb[WBBATCH];
+  struct vma *v;
+  uint64 end, e;
+  int n, r = 0;
+
+  if(addr % PGSIZE || (flags != MS_SYNC && flags != MS_ASYNC))
+    return -1;
+  end = PGROUNDUP(addr + length);
+  if(end < addr)
+    return -1;
+
+  acquire(&p->lock);
+  if(!vmacovers(p, addr, end)){
+    release(&p->lock);
+    return -1;
+  }
+
+  if(flags == MS_ASYNC){
+    release(&p->lock);
+    acquire(&tickslock);
+    wbkick = 1;
+    wakeup(&ticks);
+    release(&tickslock);
+    return 0;
+  }
 
+  // the process is in the kernel, so no TLB of ours can hold
+  // a stale dirty bit, and nothing else changes our vmas.
+  while(addr < end){
+    v = vmalookup(p, addr);
+    e = end < v->vm_end ? end : v->vm_end;
+    while(addr < e){
+      n = wbcollect(p, v, &addr, e, wb, WBBATCH);
+      release(&p->lock);
+      if(wbwrite(wb, n) < 0)
+        r = -1;
+      acquire(&p->lock);
     }
+  }
+  release(&p->lock);
+  return r;
+}
 
-    //actualizando variables del bucle
-    anterior = actual;
-    actual = actual->vm_next;
+// Drop the pages of v in [start, end) from p's page table,
+// first writing back those a shared mapping has dirtied, a
+// batch at a time. p->lock must be held; it is released
+// during the writes, and v stays valid since only p changes
+// its vmas. Returns 0, or -1 if a write failed.
+static int
+vmazap(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  struct wbpage wb[WBBATCH];
+  uint64 va = start;
+  pte_t *pte;
+  int n, r = 0;
 
+  while(va < end){
+    n = wbcollect(p, v, &va, end, wb, WBBATCH);
+    release(&p->lock);
+    if(wbwrite(wb, n) < 0)
+      r = -1;
+    acquire(&p->lock);
   }
 
-  //no se puede reservar la vma
-  printf("no se ha podido\n");
-  return MAP_FAILED;
+  for(va = start; va < end; va += PGSIZE){
+    pte = walk(p->pagetable, va, 0);
+    if(pte && (*pte & (PTE_V|PTE_SWAP)))
+      uvmunmap(p->pagetable, va, 1, 1);
+  }
+  return r;
+}
+
+// most pages one vmreclaim() looks at.
+#define CLOCKSCAN 4096
 
-  alloc:
-    vma->vm_len = length;
-    vma->vm_prot = prot;
-    vma->vm_file = p->ofile[fd];
-    vma->vm_flags = flag;
-    vma->vm_firstDir = vma->vm_start;
-    vma->vm_offset = 0;
+// State of one turn of the clock in vmreclaim().
+struct clock {
+  int want;                  // pages still to evict
+  int scan;                  // pages still to look at
+  struct wbpage wb[WBBATCH]; // dirty pages evicted, to write back
+  int nwb;
+  int out[WBBATCH];          // swap slots of pages to write out
+  int nout;
+};
 
-  p->ofile[fd]->ref++;
-  if(!p->numVmas)
-    p->vmas = vma;
-  p->numVmas++;
+// The clock's look at p's page at va: pass it over if it was
+// used since the last look, clearing its accessed bit, and
+// otherwise evict it. If ip is set, the page holds ip's data at
+// off, and if it is the page cache's own page it is unmapped,
+// to be written back first if shared is set and it is dirty.
+// Any other page no one else maps, in a private mapping, goes
+// to swap.
+static void
+clockpage(struct proc *p, struct clock *c, uint64 va,
+          struct inode *ip, uint off, int shared)
+{
+  pte_t *pte;
+  char *pa;
+  int s;
 
+  c->scan--;
+  pte = walk(p->pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0)
+    return;
+  if(*pte & PTE_A){
+    *pte &= ~PTE_A;
+    return;
+  }
+  pa = (char*)PTE2PA(*pte);
+  if(ip && pcpeek(ip, off) == pa){
+    if(shared && (*pte & PTE_D)){
+      if(c->nwb == WBBATCH)
+        return;
+      c->wb[c->nwb].ip = idup(ip);
+      c->wb[c->nwb].off = off;
+      c->wb[c->nwb].pa = pa;
+      incref(pa);
+      c->nwb++;
+    }
+    uvmunmap(p->pagetable, va, 1, 1);
+    c->want--;
+    return;
+  }
+
+  // the zero page, pages shared with other processes, and the
+  // stack guard are left alone.
+  if(shared || (*pte & PTE_U) == 0 || pa == zeropage() || getref(pa) != 1)
+    return;
+  if(c->nout == WBBATCH || (s = swapalloc(pa)) < 0)
+    return;
+  *pte = SLOT2PTE(s) | PTE_SWAP | (*pte & (PTE_R|PTE_W|PTE_X|PTE_U|PTE_COW));
+  c->out[c->nout++] = s;
+  c->want--;
+}
+
+// Move the clock over p's pages in [from, to): those below
+// p->sz, the whole pages of its program's segments being read
+// from its file, then those of its mappings that are not
+// locked.
+static void
+sweep(struct proc *p, struct clock *c, uint64 from, uint64 to)
+{
+  struct seg *s;
+  struct vma *v;
+  uint64 va, end;
+
+  end = p->sz < to ? p->sz : to;
+  for(va = PGROUNDUP(from); va < end && c->want > 0 && c->scan > 0; va += PGSIZE){
+    s = findseg(p, va);
+    if(s && va + PGSIZE <= s->va + s->filesz)
+      clockpage(p, c, va, p->exe, s->off + (va - s->va), 0);
+    else
+      clockpage(p, c, va, 0, 0, 0);
+    p->clockhand = va + PGSIZE;
+  }
+
+  for(v = vmaoverlap(p, from, to); v && v->vm_start < to; v = vmanext(p, v)){
+    if(v->vm_locked)
+      continue;
+    end = v->vm_end < to ? v->vm_end : to;
+    va = v->vm_start > from ? v->vm_start : from;
+    for(; va < end && c->want > 0 && c->scan > 0; va += PGSIZE){
+      if(v->vm_file)
+        clockpage(p, c, va, v->vm_file->ip, vmaoff(v, va),
+                  v->vm_flags == MAP_SHARED);
+      else
+        clockpage(p, c, va, 0, 0, 0);
+      p->clockhand = va + PGSIZE;
+    }
+  }
+}
+
+// Give back up to n of p's pages, by one turn of a clock from
+// p->clockhand round its address space: pages used since the
+// last turn stay, and the others are evicted. Pages that can
+// be read again from a file are unmapped, shared dirty ones
+// being written back first; the page cache then holds the only
+// reference to them, and pcreap() frees them. Anonymous pages
+// are written to swap, and freed when the writes are done.
+//
+// Only p may call this, from a trap out of user space: then
+// nothing else of p's uses its page table, and the return
+// flushes its TLB. Returns the number of pages unmapped.
+int
+vmreclaim(struct proc *p, int n)
+{
+  struct clock c;
+  uint64 hand;
+  int i;
+
+  // a vfork() child borrows its parent's page table.
+  if(p->vfparent)
+    return 0;
+  c.want = n;
+  c.scan = CLOCKSCAN;
+  c.nwb = 0;
+  c.nout = 0;
+
+  acquire(&p->lock);
+  hand = p->clockhand;
+  sweep(p, &c, hand, MAXVA);
+  if(c.want > 0 && c.scan > 0){
+    p->clockhand = 0;
+    sweep(p, &c, 0, hand);
+  }
   release(&p->lock);
-  //printf("mmap finaliza: start: %p, end: %p, proc vma: %d, vma total: %d\n",vma->vm_start,vma->vm_end,p->numVmas,i);
-  return (void *)vma->vm_start;  
 
+  for(i = 0; i < c.nout; i++)
+    swapwrite(c.out[i]);
+  wbwrite(c.wb, c.nwb);
+  return n - c.want;
 }
 
-void freeVma(struct vma *anterior, struct vma *actual, struct proc *p){
-  
-  acquire(&vma_list.lock);
-
-  //Organize the linked list of vmas
-  if(anterior == 0)
-  {
-    if(actual->vm_next == 0) p->vmas = 0;
-    else p->vmas = actual->vm_next;
-  }else if(actual->vm_next != 0) anterior->vm_next = actual->vm_next;
-    else anterior->vm_next = 0;
-
-  actual->vm_file->ref--;  //Reduce references to file 
-  actual->use = 0;
-  actual->vm_file = 0;
-  actual->vm_firstDir = 0;
-  actual->vm_start = 0;
-  actual->vm_end = 0;   
-  actual->vm_offset = 0;
-  actual->vm_next = 0;
-  actual->vm_prot = 0;
-  actual->vm_flags = 0;
-  p->numVmas--;
-
-  release(&vma_list.lock);
+// Body of the readahead kernel thread: read the pages that
+// madvise(MADV_WILLNEED) asked for into the page cache, so
+// that the faults on them find them there.
+void
+readahead(void)
+{
+  struct inode *ip;
+  uint off, n, i;
+  char *mem;
+
+  for(;;){
+    acquire(&ra.lock);
+    while(ra.r == ra.w)
+      sleep(&ra, &ra.lock);
+    ip = ra.q[ra.r % NRA].ip;
+    off = ra.q[ra.r % NRA].off;
+    n = ra.q[ra.r % NRA].npages;
+    ra.r++;
+    release(&ra.lock);
 
+    ilock(ip);
+    for(i = 0; i < n && off + i*PGSIZE < ip->size; i++){
+      if((mem = pcread(ip, off + i*PGSIZE)) == 0)
+        break;
+      putref(mem);
+    }
+    iunlock(ip);
+    begin_op();
+    iput(ip);
+    end_op();
+  }
 }
 
+// Advise the kernel how the mappings in [addr, addr+length)
+// will be used:
+// MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL set how faults in
+//   it read ahead (see mmapfault()); mappings are split so
+//   that the advice covers just the range.
+// MADV_WILLNEED has the readahead thread read its file pages
+//   into the page cache.
+// MADV_DONTNEED drops its pages now, after writing back those
+//   of a shared mapping; the next touch faults in the file's
+//   data, or zeroes for an anonymous mapping. Not allowed on
+//   pages locked by mlock().
+// MADV_MERGEABLE lets same-page merging (ksm.c) share its
+//   anonymous pages with any that are the same; mappings are
+//   split as for MADV_NORMAL. MADV_UNMERGEABLE stops it;
+//   pages already shared stay so until written.
+// Returns 0, or -1 if part of the range is not mapped or the
+// advice is unknown.
 int
-munmap(void *addr, uint64 length)
+madvise(uint64 addr, uint64 length, int advice)
 {
-  
-  //printf("nunpad entra\n");
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 end, a, e;
+  int r = 0;
+
+  if(addr % PGSIZE)
+    return -1;
+  end = PGROUNDUP(addr + length);
+  if(end <= addr)
+    return -1;
+
+  if(advice < MADV_NORMAL || advice > MADV_UNMERGEABLE)
+    return -1;
+  // la memoria de un hijo de vfork() es la del padre
+  if(p->vfparent)
+    return -1;
+
+  acquire(&p->lock);
+  if(!vmacovers(p, addr, end)){
+    release(&p->lock);
+    return -1;
+  }
+
+  for(a = addr; a < end && r == 0; a = e){
+    v = vmalookup(p, a);
+    e = end < v->vm_end ? end : v->vm_end;
+    switch(advice){
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+      if((v = vmaclip(p, v, a, e)) == 0){
+        r = -1;
+        break;
+      }
+      v->vm_advice = advice;
+      v->vm_window = 1;
+      break;
+    case MADV_WILLNEED:
+      if(v->vm_file == 0)
+        break;
+      // advice only: if the queue is full, forget it.
+      acquire(&ra.lock);
+      if(ra.w - ra.r < NRA){
+        ra.q[ra.w % NRA].ip = idup(v->vm_file->ip);
+        ra.q[ra.w % NRA].off = vmaoff(v, a);
+        ra.q[ra.w % NRA].npages = (e - a) / PGSIZE;
+        ra.w++;
+        wakeup(&ra);
+      }
+      release(&ra.lock);
+      break;
+    case MADV_DONTNEED:
+      if(v->vm_locked){
+        r = -1;
+        break;
+      }
+      r = vmazap(p, v, a, e);
+      break;
+    case MADV_MERGEABLE:
+    case MADV_UNMERGEABLE:
+      if((v = vmaclip(p, v, a, e)) == 0){
+        r = -1;
+        break;
+      }
+      v->vm_merge = advice == MADV_MERGEABLE;
+      break;
+    }
+  }
+  release(&p->lock);
+  return r;
+}
+
+// Fault in every page of [start, end) that is not mapped yet,
+// for MAP_POPULATE and mlock(). File pages come a FAULTAROUND
+// window per fault, so per ilock(); pages past the end of the
+// file are left alone. Pages of a writable anonymous mapping
+// are allocated rather than mapped to the zero page, so that
+// the first store does not fault either. Called without
+// p->lock. Returns 0, or -1 if a page could not be had.
+static int
+vmapopulate(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v, *sized = 0;
+  pte_t *pte;
+  uint64 a;
+  uint size = 0;
+  int write;
 
+  for(a = start; a < end; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V))
+      continue;
+    if((v = vmalookup(p, a)) == 0)
+      return -1;
+    if(v->vm_prot == PROT_NONE)
+      continue;
+    write = 0;
+    if(v->vm_file == 0){
+      write = (v->vm_prot & PROT_WRITE) != 0;
+    } else {
+      if(v != sized){
+        ilock(v->vm_file->ip);
+        size = v->vm_file->ip->size;
+        iunlock(v->vm_file->ip);
+        sized = v;
+      }
+      if(vmaoff(v, a) >= size)
+        continue;
+      if(v->vm_advice != MADV_RANDOM){
+        v->vm_nextfault = a;
+        v->vm_window = FAULTAROUND;
+      }
+    }
+    if(mmapfault(p, a, write) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Lock (lock=1) or unlock the mappings in [addr, addr+length).
+// Locked pages are faulted in now and stay mapped until
+// munlock() or munmap(): neither madvise() nor the kernel drops
+// them. Mappings are split so that the lock covers just the
+// range. Returns 0, or -1 if part of the range is not mapped
+// or its pages cannot all be had.
+int
+mlock(uint64 addr, uint64 length, int lock)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 end, a, e;
+
+  if(addr % PGSIZE)
+    return -1;
+  end = PGROUNDUP(addr + length);
+  if(end <= addr)
+    return -1;
+
+  acquire(&p->lock);
+  if(!vmacovers(p, addr, end)){
+    release(&p->lock);
+    return -1;
+  }
+  for(a = addr; a < end; a = e){
+    v = vmalookup(p, a);
+    e = end < v->vm_end ? end : v->vm_end;
+    if((v = vmaclip(p, v, a, e)) == 0){
+      release(&p->lock);
+      return -1;
+    }
+    v->vm_locked = lock;
+  }
+  release(&p->lock);
+
+  if(lock)
+    return vmapopulate(p, addr, end);
+  return 0;
+}
+
+// The pte of a page mapped by v, old, with its access changed
+// to prot. PROT_NONE only takes away user access, keeping the
+// rest for when access comes back. A private mapping only gets
+// write access directly for a page that is its own copy; other
+// pages become copy-on-write. The pte of a page out on swap
+// keeps its slot.
+static pte_t
+protpte(struct vma *v, pte_t old, int prot)
+{
+  pte_t pte;
+
+  if(prot == PROT_NONE)
+    return old & ~PTE_U;
+  pte = (old & ~(PTE_R|PTE_W|PTE_X|PTE_COW)) | PTE_R | PTE_U | (prot & PTE_X);
+  if(prot & PROT_WRITE){
+    if(v->vm_flags == MAP_SHARED || (old & PTE_W))
+      pte |= PTE_W;
+    else
+      pte |= PTE_COW;
+  }
+  return pte;
+}
+
+// Change the access to the mappings in [addr, addr+length) to
+// prot, a combination of PROT_READ, PROT_WRITE and PROT_EXEC,
+// or PROT_NONE. Mappings are split so that prot covers just the
+// range, and the pages already mapped keep their place and
+// contents: only their ptes change. Returns 0, or -1 if part
+// of the range is not mapped, or prot asks to write a shared
+// mapping of a file not open for writing.
+int
+mprotect(uint64 addr, uint64 length, int prot)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 end, a, e, va;
+  pte_t *pte;
+
+  if(addr % PGSIZE || (prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)))
+    return -1;
+  end = PGROUNDUP(addr + length);
+  if(end <= addr)
+    return -1;
+  // la memoria de un hijo de vfork() es la del padre
+  if(p->vfparent)
+    return -1;
+
+  acquire(&p->lock);
+  if(!vmacovers(p, addr, end)){
+    release(&p->lock);
+    return -1;
+  }
+  for(a = addr; a < end; a = v->vm_end){
+    v = vmalookup(p, a);
+    if((prot & PROT_WRITE) && v->vm_flags == MAP_SHARED && !v->vm_file->writable){
+      release(&p->lock);
+      return -1;
+    }
+  }
+
+  for(a = addr; a < end; a = e){
+    v = vmalookup(p, a);
+    e = end < v->vm_end ? end : v->vm_end;
+    if((v = vmaclip(p, v, a, e)) == 0)
+      break;
+    v->vm_prot = prot;
+    for(va = a; va < e; va += PGSIZE){
+      pte = walk(p->pagetable, va, 0);
+      if(pte && (*pte & (PTE_V|PTE_SWAP)))
+        *pte = protpte(v, *pte, prot);
+    }
+  }
+  release(&p->lock);
+  return a < end ? -1 : 0;
+}
+
+int
+munmap(void *addr, uint64 length)
+{
   // tomamos la informacion del proceso actual
   struct proc *p = myproc(); 
+  struct file *f;
+  int r = 0;
+
+  // la memoria de un hijo de vfork() es la del padre
+  if(p->vfparent)
+    return -1;
+
   acquire(&p->lock);
-  struct vma *actual = p->vmas;
-  struct vma *anterior = 0;
   uint64 addrU= (uint64)addr;
 
-  //Comprobamos que la dirrecion sea de una vma
-  int i = 0;
-  for(i = 0; i<p->numVmas; i++)
-  {
-    if( addrU+length >= actual->vm_start && addrU+length <= actual->vm_end
-     && addrU >= actual->vm_start && addrU < actual->vm_end ) break;
-    
-    anterior = actual;
-    actual = actual->vm_next;
-  }
+  // variables para el desmapeo
+  uint64 va = PGROUNDDOWN(addrU);
+  uint64 end = va + PGROUNDUP(length);
+  uint64 s, e;
 
-  //hemos pasado todas las vmas y no se ha encontrado ninguna
-  if(i == p->numVmas){
+  //Comprobamos que el rango toque alguna vma
+  struct vma *actual;
+  if(end <= va || (actual = vmaoverlap(p, va, end)) == 0){
     release(&p->lock);
-    printf("nunmap: fallo no se encuentra vmas\n");
     return -1; 
   }
 
-  // variables para el desmapeo
-  pte_t *pte;
-  int escritos = 0;
-  int aux = 0;
-
-  //recorre las enstradas de la tabla de paginas
-  for(i = 0; i < PGROUNDUP(length)/PGSIZE; i++)
-  {
-    pte =  walk(p->pagetable, PGROUNDDOWN(addrU+i*PGSIZE), 0);
-    
-    // la pagina esta mapeada
-    if(*pte & PTE_V)
-    {
-      //Comprueba si el mapeo es compartido y que este el bit de sucio activo
-      if( (*pte & PTE_D) && actual->vm_flags == MAP_SHARED)
-      {
-        ilock(actual->vm_file->ip);
-        escritos = PGSIZE*(i+1) - actual->vm_file->ip->size;
-        
-        // Selecionamos el tamño a escribir
-        if(escritos > 0) aux = 1;
-        else escritos = PGSIZE;
-
-        //Escribimos en el disco los nuevos datos
-        if(writei(actual->vm_file->ip, 1, PGROUNDDOWN(addrU+i*PGSIZE), PGROUNDDOWN(addrU+i*PGSIZE)-actual->vm_firstDir, escritos) == -1)
-        {
-          iunlock(actual->vm_file->ip);  
-          release(&p->lock);
-          printf("nunmap: fallo al escribir en disco\n");
-          return -1;
-        }
+  //cada vma que toca el rango, de la mas baja a la mas alta
+  do {
+    s = va > actual->vm_start ? va : actual->vm_start;
+    e = end < actual->vm_end ? end : actual->vm_end;
 
-        iunlock(actual->vm_file->ip);
+    //quitar el medio de una vma la parte en dos: la parte de
+    //arriba pasa a ser otra vma del mismo fichero
+    if(s > actual->vm_start && e < actual->vm_end){
+      if(vmasplit(p, actual, e) == 0){
+        r = -1;
+        break;
       }
-
-      uvmunmap(p->pagetable, PGROUNDDOWN(addrU+i*PGSIZE), 1, 1);
-        if(aux) break;
     }
-  }
 
-  if(actual->vm_start+PGROUNDUP(length) == actual->vm_end) freeVma(anterior,actual,p);
-  else if(actual->vm_start == addrU) actual->vm_start = actual->vm_start+PGROUNDUP(length); //Colocamos una nueva direcion de comienzo  
-  else actual->vm_end = PGROUNDDOWN(addrU); //Colocamos una nueva direcion de final
+    //se escriben las paginas sucias y se desmapean
+    if(vmazap(p, actual, s, e) < 0)
+      r = -1;
+
+    if(s == actual->vm_start && e == actual->vm_end){
+      //la vma entera: el fichero se cierra sin p->lock
+      f = actual->vm_file;
+      vmaremove(p, actual);
+      vmafree(actual);
+      if(f){
+        release(&p->lock);
+        fileclose(f);
+        acquire(&p->lock);
+      }
+    }
+    else if(s == actual->vm_start) vmaresize(p, actual, e, actual->vm_end); //Colocamos una nueva direcion de comienzo  
+    else vmaresize(p, actual, actual->vm_start, s); //Colocamos una nueva direcion de final
+  } while((actual = vmaoverlap(p, e, end)) != 0);
 
   release(&p->lock);
-  return 0;
+  return r;
 
-}
\ No newline at end of file
+}
@@ -1,6 +1,30 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each CPU keeps its own free list so that kalloc() and kfree()
+// normally touch only a per-CPU lock. Pages move between the
+// per-CPU lists and the shared pool (the buddy allocator in
+// buddy.c) in batches of KBATCH; a CPU whose list and the shared
+// pool are both empty steals half of another CPU's list.
+//
+// kallocpages() allocates physically contiguous blocks of
+// 2^order pages directly from the buddy allocator.
+//
+// kalloc_zeroed() hands out pages from a pool that the scheduler
+// refills with zeroed pages while its CPU is idle, so that most
+// callers that need a zero page don't pay for the memset.
+//
+// zeropage() is a single read-only page of zeros, mapped
+// copy-on-write wherever a process reads memory it has never
+// written.
+//
+// When the free pages fall below RECLAIMLOW, or an allocation
+// fails, kmem.low is set, and the reclaim thread (reclaim.c)
+// takes pages back from processes until RECLAIMHIGH are free.
+//
+// Build with KALLOC_JUNK defined (make JUNK=1) to fill pages with
+// junk on every allocation and free, to catch dangling references.
 
 #include "types.h"
 #include "param.h"
@@ -8,126 +32,325 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "memstat.h"
 
-#define MAXPAGES (PHYSTOP / PGSIZE)
-
-void _freerange(void *pa_vstart, void *pa_vend);
-void freerange(void *pa_start, void *pa_end);
-void _kfree(void *pa);
+#define KBATCH 32          // pages moved to/from the shared pool at once
+#define KHIGH  (4*KBATCH)  // drain a per-CPU list longer than this
+#define ZPOOL  256         // zeroed pages kept ready for kalloc_zeroed()
+#define ZIDLE  8           // pages zeroed per idle call
+#define RECLAIMLOW  (MAXPAGES/32)  // start reclaim below this many free pages
+#define RECLAIMHIGH (MAXPAGES/16)  // and stop once this many are free
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+// A free page. The link lives in the page itself, since
+// a free page holds nothing else; only the reference
+// count needs to survive while the page is allocated.
 struct run {
   struct run *next;
-  uint ref; // reference count
 };
 
-struct {
+// Per-CPU free list.
+struct kcpu {
   struct spinlock lock;
   struct run *freelist;
-  // DEP: For COW fork, we can't store the run in the 
-  //      physical page, because we need space for the ref
-  //      count.  Move to the kmem struct.
-  struct run runs[MAXPAGES];
+  int nfree;
+};
+
+struct {
+  struct kcpu cpu[NCPU];
+  struct spinlock zlock;   // protects the zeroed-page pool
+  struct run *zero;        // zeroed pages, linked through their first word
+  int nzero;
+  char *zeropage;          // shared zero page; holds a reference forever
+  int low;                 // free memory ran low; see kmemlow()
+  uint nfail;              // times kalloc() found no page
+  // Per-page reference counts, one for each page of RAM from
+  // KERNBASE to PHYSTOP, for COW fork and shared mappings.
+  // Only ever changed with atomic (AMO) instructions.
+  int ref[MAXPAGES];
 } kmem;
 
+static void
+checkpa(void *pa, char *who)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic(who);
+}
+
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  _freerange(end, (void*)PHYSTOP);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem_cpu");
+  initlock(&kmem.zlock, "kmem_zero");
+  buddyinit(end, (void*)PHYSTOP);
+  if((kmem.zeropage = kalloc_zeroed()) == 0)
+    panic("kinit: zero page");
 }
 
-void
-_freerange(void *pa_start, void *pa_end)
+// Move up to n pages from the front of list *from
+// to the front of list *to. Returns the number moved.
+static int
+movepages(struct run **from, struct run **to, int n)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    _kfree(p);
+  struct run *r;
+  int i;
+
+  for(i = 0; i < n && *from; i++){
+    r = *from;
+    *from = r->next;
+    r->next = *to;
+    *to = r;
+  }
+  return i;
 }
 
-void
-freerange(void *pa_start, void *pa_end)
+// Take pages from another CPU's free list.
+// Caller must not hold any kmem lock.
+// Returns the number of pages moved to c.
+static int
+steal(struct kcpu *c)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  struct run *got = 0;
+  struct kcpu *v;
+  int n = 0;
+
+  for(v = kmem.cpu; v < kmem.cpu + NCPU && n == 0; v++){
+    if(v == c || v->nfree == 0)
+      continue;
+    acquire(&v->lock);
+    n = movepages(&v->freelist, &got, (v->nfree + 1) / 2);
+    v->nfree -= n;
+    release(&v->lock);
+  }
+
+  if(n){
+    acquire(&c->lock);
+    c->nfree += movepages(&got, &c->freelist, n);
+    release(&c->lock);
+  }
+  return n;
 }
 
-// Called by _freerange, which is only called by kinit.
-void
-_kfree(void *pa)
+// Move up to n pages from list *from back to the buddy
+// allocator. Returns the number moved.
+static int
+drain(struct run **from, int n)
+{
+  void *pg[KBATCH];
+  int i;
+
+  if(n > KBATCH)
+    n = KBATCH;
+  for(i = 0; i < n && *from; i++){
+    pg[i] = *from;
+    *from = (*from)->next;
+  }
+  buddyfreebatch(pg, i);
+  return i;
+}
+
+// Refill c's list with up to KBATCH pages from the buddy
+// allocator. Caller holds c->lock.
+static void
+refill(struct kcpu *c)
 {
+  void *pg[KBATCH];
   struct run *r;
+  int i, n;
 
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
-    panic("_kfree");
+  n = buddyallocbatch(pg, KBATCH);
+  for(i = 0; i < n; i++){
+    r = pg[i];
+    r->next = c->freelist;
+    c->freelist = r;
+  }
+  c->nfree += n;
+  if(buddynfree() < RECLAIMLOW)
+    kmem.low = 1;
+}
+
+// Put a page whose reference count has reached zero
+// on this CPU's free list.
+static void
+freepage(void *pa)
+{
+  struct run *r;
 
+#ifdef KALLOC_JUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
-  r = &kmem.runs[(uint64)pa / PGSIZE];
+  r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  struct kcpu *c = &kmem.cpu[cpuid()];
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  c->nfree++;
+  if(c->nfree > KHIGH){
+    // give a batch back to the shared pool so other
+    // CPUs can refill without stealing.
+    c->nfree -= drain(&c->freelist, KBATCH);
+  }
+  release(&c->lock);
+  pop_off();
 }
 
-
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The caller must hold the only reference; use
+// putref() for pages that may be shared.
 void
 kfree(void *pa)
+{
+  int old;
+
+  checkpa(pa, "kfree");
+
+  if((old = __sync_val_compare_and_swap(&kmem.ref[PA2PG(pa)], 1, 0)) != 1){
+    printf("kfree: pa %p ref %d\n", pa, old);
+    panic("kfree: ref");
+  }
+  freepage(pa);
+}
+
+// Take a page from the zeroed pool, or return 0 if it is empty.
+// The link word is the only non-zero part of a pooled page.
+static void *
+zpop(void)
 {
   struct run *r;
 
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
-    panic("kfree");
+  acquire(&kmem.zlock);
+  if((r = kmem.zero) != 0){
+    kmem.zero = r->next;
+    kmem.nzero--;
+  }
+  release(&kmem.zlock);
+  if(r)
+    r->next = 0;
+  return r;
+}
 
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+// Take a page from this CPU's list, refilling it from the
+// buddy allocator if it is empty. Returns 0 if both are empty.
+static struct run *
+cpualloc(void)
+{
+  struct run *r;
+  struct kcpu *c;
 
-  r = &kmem.runs[(uint64)pa / PGSIZE];
-  if (r->ref != 1) {
-    // assert ref == 1
-    printf("kfree: assert ref == 1 failed\n");
-    printf("0x%x %d\n", r, r->ref);
-    exit(-1);
+  push_off();
+  c = &kmem.cpu[cpuid()];
+  acquire(&c->lock);
+  if(c->freelist == 0)
+    refill(c);
+  r = c->freelist;
+  if(r){
+    c->freelist = r->next;
+    c->nfree--;
   }
-  
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  release(&c->lock);
+  pop_off();
+  return r;
+}
+
+// Give back pages held by the page cache and the slab caches.
+// Returns the number of pages freed.
+static int
+reclaim(void)
+{
+  int n;
+
+  // the page cache frees slab objects too, so reap it first.
+  n = pcreap();
+  return n + slabreap();
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// The page's contents are undefined.
 void *
 kalloc(void)
 {
   struct run *r;
+  int reaped = 0;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r){
-    r->ref = 1;
-    kmem.freelist = r->next;
+  push_off();
+  while((r = cpualloc()) == 0){
+    // out of pages here: steal from another CPU, and failing
+    // that, once, shrink the caches.
+    if(steal(&kmem.cpu[cpuid()]) == 0 && (reaped++ || reclaim() == 0))
+      break;
   }
-  release(&kmem.lock);
+  pop_off();
 
-  if(r){
-    memset((char*)((r - kmem.runs) * PGSIZE), 5, PGSIZE); // fill with junk
-    return (void*)((r - kmem.runs) * PGSIZE);
-  }  
-  return (void*)0;
+  if(r == 0 && (r = zpop()) == 0){
+    __sync_fetch_and_add(&kmem.nfail, 1);
+    kmem.low = 1;
+    return 0;
+  }
+
+  // nobody else can see the page yet, so a plain store is enough.
+  kmem.ref[PA2PG(r)] = 1;
+#ifdef KALLOC_JUNK
+  memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// Allocate one zero-filled page.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  char *pa;
+
+  if((pa = zpop()) != 0){
+    kmem.ref[PA2PG(pa)] = 1;
+    return pa;
+  }
+  if((pa = kalloc()) != 0)
+    memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+// The shared zero page. Map it only read-only and with
+// PTE_COW, taking a reference with incref().
+void *
+zeropage(void)
+{
+  return kmem.zeropage;
+}
+
+// Called by the scheduler when it found nothing to run:
+// zero a few free pages and add them to the pool.
+void
+kzeroidle(void)
+{
+  struct run *r;
+
+  // only use pages this CPU can get cheaply; never steal
+  // or reap for the pool.
+  for(int i = 0; i < ZIDLE && kmem.nzero < ZPOOL; i++){
+    if((r = cpualloc()) == 0)
+      return;
+    memset(r, 0, PGSIZE);
+    kmem.ref[PA2PG(r)] = 0;
+    acquire(&kmem.zlock);
+    r->next = kmem.zero;
+    kmem.zero = r;
+    kmem.nzero++;
+    release(&kmem.zlock);
+  }
 }
 
 
@@ -137,50 +360,151 @@ kalloc(void)
 void
 incref(void *pa)
 {
-  struct run *r;
-
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
-    panic("incref");
-
-  acquire(&kmem.lock);
-  r = &kmem.runs[(uint64)pa / PGSIZE];
-  r->ref++;
-  release(&kmem.lock);
+  checkpa(pa, "incref");
+  __sync_fetch_and_add(&kmem.ref[PA2PG(pa)], 1);
 }
 
 /**
- * Decrement the reference count of a page descriptor.
+ * Decrement the reference count of a page descriptor
+ * and return the new count. Never frees the page.
  */
-void
+int
 decref(void *pa)
 {
-  struct run *r;
+  int n;
 
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
-    panic("decref");
+  checkpa(pa, "decref");
+  n = __sync_sub_and_fetch(&kmem.ref[PA2PG(pa)], 1);
+  if(n < 0)
+    panic("decref: underflow");
+  return n;
+}
 
-  acquire(&kmem.lock);
-  r = &kmem.runs[(uint64)pa / PGSIZE];
-  r->ref--;
-  release(&kmem.lock);
+/**
+ * Drop one reference to a page and free it if that was
+ * the last one. Exactly one of any number of concurrent
+ * callers sees the count reach zero, so the page is freed
+ * exactly once.
+ */
+void
+putref(void *pa)
+{
+  if(decref(pa) == 0)
+    freepage(pa);
 }
 
 /**
  * Get reference count of a page descriptor.
  */
-uint
+int
 getref(void *pa)
 {
-  struct run *r = &kmem.runs[(uint64)pa / PGSIZE];
-  return r->ref;
+  checkpa(pa, "getref");
+  return __atomic_load_n(&kmem.ref[PA2PG(pa)], __ATOMIC_ACQUIRE);
 }
 
-/**
- * Print reference count of a page descriptor.
- */
+// Return every page cached on the per-CPU lists to the buddy
+// allocator, so that they can coalesce into larger blocks.
 void
-printref(char *pa)
+kdrain(void)
 {
-  struct run *r = &kmem.runs[(uint64)pa / PGSIZE];
-  printf("printref: address: 0x%p, ref: %d\n", r, r->ref);
-}
\ No newline at end of file
+  struct kcpu *c;
+
+  for(c = kmem.cpu; c < kmem.cpu + NCPU; c++){
+    acquire(&c->lock);
+    while(c->freelist)
+      c->nfree -= drain(&c->freelist, KBATCH);
+    release(&c->lock);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Each page starts with a reference count of one.
+// Returns 0 if no such block is free.
+void *
+kallocpages(int order)
+{
+  char *pa;
+
+  if(order < 0 || order >= NORDER)
+    return 0;
+  if((pa = buddyalloc(order)) == 0){
+    // free pages may be stranded on per-CPU lists.
+    kdrain();
+    if((pa = buddyalloc(order)) == 0)
+      return 0;
+  }
+  for(int i = 0; i < (1 << order); i++)
+    kmem.ref[PA2PG(pa) + i] = 1;
+#ifdef KALLOC_JUNK
+  memset(pa, 5, PGSIZE << order); // fill with junk
+#endif
+  return pa;
+}
+
+// Free a block returned by kallocpages(order).
+void
+kfreepages(void *pa, int order)
+{
+  checkpa(pa, "kfreepages");
+  for(int i = 0; i < (1 << order); i++)
+    if(__sync_val_compare_and_swap(&kmem.ref[PA2PG(pa) + i], 1, 0) != 1)
+      panic("kfreepages: ref");
+#ifdef KALLOC_JUNK
+  memset(pa, 1, PGSIZE << order);
+#endif
+  buddyfree(pa, order);
+}
+
+// Return the number of free pages, counted without locks:
+// an estimate, for deciding when to reclaim.
+uint64
+knfree(void)
+{
+  struct kcpu *c;
+  uint64 n;
+
+  n = buddynfree() + kmem.nzero;
+  for(c = kmem.cpu; c < kmem.cpu + NCPU; c++)
+    n += c->nfree;
+  return n;
+}
+
+// Return 1 if free memory has run low and has not yet been
+// brought back up to RECLAIMHIGH pages.
+int
+kmemlow(void)
+{
+  if(kmem.low && knfree() >= RECLAIMHIGH)
+    kmem.low = 0;
+  return kmem.low;
+}
+
+// Return the number of kalloc() calls that have failed, so
+// that a caller can tell whether an operation failed for want
+// of memory.
+uint
+kallocfails(void)
+{
+  return __atomic_load_n(&kmem.nfail, __ATOMIC_ACQUIRE);
+}
+
+// Report free memory, for the memstat() system call.
+void
+kmemstat(struct memstat *st)
+{
+  struct kcpu *c;
+
+  memset(st, 0, sizeof(*st));
+  for(c = kmem.cpu; c < kmem.cpu + NCPU; c++)
+    st->nfreecpu += c->nfree;
+  buddystat(st);
+  slabstat(st);
+  st->nzero = kmem.nzero;
+  st->nzeromap = getref(kmem.zeropage) - 1;
+  pcstat(st);
+  reclaimstat(st);
+  swapstat(st);
+  ksmstat(st);
+  st->nfree += st->nfreecpu + st->nzero;
+}
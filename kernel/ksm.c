@@ -0,0 +1,272 @@
+// Same-page merging.
+//
+// Pages of anonymous mappings that madvise(MADV_MERGEABLE)
+// marks are compared with each other, across processes, and
+// those with the same contents are made to share one page,
+// copy-on-write, so the others are freed.
+//
+// As with reclaim (reclaim.c), the thread here only asks the
+// processes, and each looks at its own pages on its way back to
+// user space (ksmself()), since only it can know no TLB holds
+// the ptes it changes. A page is a candidate only if no one
+// else maps it and it was not written since the last look (its
+// dirty bit, which the look clears, is clear). Its hash is then
+// looked up among the merged pages, and if one is the same the
+// page is replaced by it. If not, a second page with a hash
+// seen before is probably the same as the first, so it becomes
+// a merged page itself, for the first to find next time. Pages
+// of zeroes are merged into the shared zero page.
+//
+// The table of merged pages holds a reference to each; the
+// pages are mapped copy-on-write only, so they do not change
+// while listed. Once no one maps one, the thread frees it.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "vma.h"
+#include "memstat.h"
+
+#define KSMTICKS 5     // ticks between rounds
+#define KSMSCAN  128   // pages a process is asked to look at
+#define NKSMHASH 64    // buckets of merged pages
+#define NKSMHINT 1024  // hashes of pages seen lately
+
+extern struct proc proc[NPROC];
+
+struct ksmpage {
+  char *pa;
+  uint64 hash;
+  struct ksmpage *next;
+};
+
+// a page seen lately, which was not merged.
+struct ksmhint {
+  uint64 hash;
+  char *pa;
+};
+
+struct {
+  struct spinlock lock;
+  struct slabcache *cache;
+  struct ksmpage *bucket[NKSMHASH];
+  struct ksmhint hint[NKSMHINT];
+  uint64 zerohash;
+  uint64 nmerged;         // pages replaced by another
+} ksm;
+
+static uint64
+ksmhash(char *pa)
+{
+  uint64 *w = (uint64*)pa;
+  uint64 h = 14695981039346656037ULL;
+
+  for(int i = 0; i < PGSIZE/8; i++)
+    h = (h ^ w[i]) * 1099511628211ULL;
+  return (h ^ (h >> 32)) | 1;
+}
+
+// Make the pte *pte, for a page shared copy-on-write, map pa.
+static void
+ksmmap(pte_t *pte, char *pa)
+{
+  uint flags = PTE_FLAGS(*pte) & ~PTE_W;
+
+  if(*pte & PTE_W)
+    flags |= PTE_COW;
+  *pte = PA2PTE(pa) | flags;
+}
+
+// Look at p's page at va, and merge it if it can be.
+static void
+ksmpage(struct proc *p, uint64 va)
+{
+  struct ksmpage *k;
+  struct ksmhint *hint;
+  pte_t *pte;
+  char *pa;
+  uint64 h;
+
+  pte = walk(p->pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return;
+  pa = (char*)PTE2PA(*pte);
+  if(pa == zeropage() || getref(pa) != 1)
+    return;
+  if(*pte & PTE_D){
+    *pte &= ~PTE_D;
+    return;
+  }
+
+  h = ksmhash(pa);
+  if(h == ksm.zerohash && memcmp(pa, zeropage(), PGSIZE) == 0){
+    incref(zeropage());
+    ksmmap(pte, zeropage());
+    putref(pa);
+    __sync_fetch_and_add(&ksm.nmerged, 1);
+    return;
+  }
+
+  acquire(&ksm.lock);
+  for(k = ksm.bucket[h % NKSMHASH]; k; k = k->next){
+    if(k->hash == h && memcmp(k->pa, pa, PGSIZE) == 0){
+      incref(k->pa);
+      ksmmap(pte, k->pa);
+      release(&ksm.lock);
+      __sync_fetch_and_add(&ksm.nmerged, 1);
+      putref(pa);
+      return;
+    }
+  }
+  hint = &ksm.hint[h % NKSMHINT];
+  if(hint->hash != h || hint->pa == pa){
+    hint->hash = h;
+    hint->pa = pa;
+  } else if((k = slaballoc(ksm.cache)) != 0){
+    k->pa = pa;
+    k->hash = h;
+    k->next = ksm.bucket[h % NKSMHASH];
+    ksm.bucket[h % NKSMHASH] = k;
+    incref(pa);
+    ksmmap(pte, pa);
+  }
+  release(&ksm.lock);
+}
+
+// Look at up to n pages of p's mergeable mappings in
+// [from, to). Returns the number left. p is the current
+// process, so its vmas stay put; p->lock is held only for
+// each page, which the writeback thread may be looking at.
+static int
+ksmscan(struct proc *p, uint64 from, uint64 to, int n)
+{
+  struct vma *v;
+  uint64 va, end;
+
+  for(v = vmaoverlap(p, from, to); v && v->vm_start < to && n > 0; v = vmanext(p, v)){
+    // mlock()ed pages stay as they are.
+    if(!v->vm_merge || v->vm_file || v->vm_locked)
+      continue;
+    end = v->vm_end < to ? v->vm_end : to;
+    va = v->vm_start > from ? v->vm_start : from;
+    for(; va < end && n > 0; va += PGSIZE, n--){
+      acquire(&p->lock);
+      ksmpage(p, va);
+      release(&p->lock);
+      p->ksmhand = va + PGSIZE;
+    }
+  }
+  return n;
+}
+
+static int
+mergeable(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = vmafirst(p); v; v = vmanext(p, v))
+    if(v->vm_merge && v->vm_file == 0 && !v->vm_locked)
+      return 1;
+  return 0;
+}
+
+// Free the merged pages no one maps any more.
+static void
+ksmreap(void)
+{
+  struct ksmpage **kp, *k;
+  int i;
+
+  acquire(&ksm.lock);
+  for(i = 0; i < NKSMHASH; i++){
+    for(kp = &ksm.bucket[i]; (k = *kp) != 0; ){
+      // only the table maps it, so nothing can add a reference.
+      if(getref(k->pa) == 1){
+        *kp = k->next;
+        putref(k->pa);
+        slabfree(ksm.cache, k);
+      } else {
+        kp = &k->next;
+      }
+    }
+  }
+  release(&ksm.lock);
+}
+
+void
+ksminit(void)
+{
+  initlock(&ksm.lock, "ksm");
+  ksm.cache = slabcreate("ksm", sizeof(struct ksmpage));
+  ksm.zerohash = ksmhash(zeropage());
+}
+
+// Body of the merging kernel thread.
+void
+ksmscanner(void)
+{
+  struct proc *p;
+  uint t0;
+
+  for(;;){
+    acquire(&tickslock);
+    t0 = ticks;
+    while(ticks - t0 < KSMTICKS)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    for(p = proc; p < &proc[NPROC]; p++){
+      acquire(&p->lock);
+      if(p->state != UNUSED && p->state != ZOMBIE && p->kfn == 0 &&
+         mergeable(p))
+        p->ksm = KSMSCAN;
+      release(&p->lock);
+    }
+    ksmreap();
+  }
+}
+
+// Look at the pages the thread asked p to. p is the current
+// process, in a trap from user space.
+void
+ksmself(struct proc *p)
+{
+  uint64 hand;
+  int n;
+
+  acquire(&p->lock);
+  n = p->ksm;
+  p->ksm = 0;
+  release(&p->lock);
+  // a vfork() child borrows its parent's page table.
+  if(p->vfparent == 0){
+    hand = p->ksmhand;
+    if((n = ksmscan(p, hand, MAXVA, n)) > 0){
+      p->ksmhand = 0;
+      ksmscan(p, 0, hand, n);
+    }
+  }
+}
+
+void
+ksmstat(struct memstat *st)
+{
+  struct ksmpage *k;
+  int i, ref;
+
+  acquire(&ksm.lock);
+  for(i = 0; i < NKSMHASH; i++){
+    for(k = ksm.bucket[i]; k; k = k->next){
+      st->nksmshared++;
+      // one reference is the table's, one the page's own.
+      if((ref = getref(k->pa)) > 2)
+        st->nksmsaved += ref - 2;
+    }
+  }
+  st->nksmmerged = ksm.nmerged;
+  release(&ksm.lock);
+}
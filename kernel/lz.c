@@ -0,0 +1,168 @@
+// LZ77 compression of pages, for zram.c.
+//
+// The format is that of an LZ4 block: a series of sequences,
+// each a token byte, a run of literal bytes, and a match.
+// The token's high four bits are the number of literals and
+// its low four bits the match length less LZMINMATCH; a field
+// of 15 continues in the bytes that follow (after the token
+// for literals, after the offset for the match), each added
+// in, until one is not 255. The match is a two-byte
+// little-endian offset back into the output, copied from for
+// the match length. The last sequence has literals only.
+//
+// The compressor finds matches through a hash table of the
+// positions of recent four-byte strings; one per CPU, so the
+// caller must keep interrupts off.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define LZMINMATCH 4
+#define LZHASHBITS 10
+#define LZHASH     (1 << LZHASHBITS)
+
+static ushort lztab[NCPU][LZHASH];
+
+static uint
+lzhash(uchar *p)
+{
+  uint v = p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24;
+
+  return (v * 2654435761U) >> (32 - LZHASHBITS);
+}
+
+// Append the length n beyond a field of 15 to op.
+static uchar*
+lzlen(uchar *op, uchar *oend, int n)
+{
+  for(; n >= 255; n -= 255){
+    if(op == oend)
+      return 0;
+    *op++ = 255;
+  }
+  if(op == oend)
+    return 0;
+  *op++ = n;
+  return op;
+}
+
+// Append a sequence of nlit literals from lit and, if mlen is
+// not 0, a match of mlen bytes at off back. Returns the new
+// end of the output, or 0 if it would pass oend.
+static uchar*
+lzseq(uchar *op, uchar *oend, uchar *lit, int nlit, int off, int mlen)
+{
+  uchar *token;
+  int m = mlen - LZMINMATCH;
+
+  if(op == oend)
+    return 0;
+  token = op++;
+  *token = (nlit < 15 ? nlit : 15) << 4;
+  if(nlit >= 15 && (op = lzlen(op, oend, nlit - 15)) == 0)
+    return 0;
+  if(nlit > oend - op)
+    return 0;
+  memmove(op, lit, nlit);
+  op += nlit;
+  if(mlen == 0)
+    return op;
+
+  if(oend - op < 2)
+    return 0;
+  *op++ = off;
+  *op++ = off >> 8;
+  *token |= m < 15 ? m : 15;
+  if(m >= 15 && (op = lzlen(op, oend, m - 15)) == 0)
+    return 0;
+  return op;
+}
+
+// Compress the n bytes at src, n < 65536, into at most max
+// bytes at dst. Returns the compressed length, or -1 if it
+// would be more than max.
+int
+lzcompress(uchar *src, int n, uchar *dst, int max)
+{
+  ushort *tab = lztab[cpuid()];
+  uchar *ip = src, *anchor = src, *end = src + n;
+  uchar *op = dst, *oend = dst + max;
+  uchar *ref;
+  uint h;
+  int mlen;
+
+  memset(tab, 0, sizeof(lztab[0]));
+  while(end - ip >= LZMINMATCH){
+    h = lzhash(ip);
+    ref = src + tab[h];
+    tab[h] = ip - src;
+    if(ref >= ip || ref[0] != ip[0] || ref[1] != ip[1] ||
+       ref[2] != ip[2] || ref[3] != ip[3]){
+      ip++;
+      continue;
+    }
+    for(mlen = LZMINMATCH; ip + mlen < end && ref[mlen] == ip[mlen]; mlen++)
+      ;
+    if((op = lzseq(op, oend, anchor, ip - anchor, ip - ref, mlen)) == 0)
+      return -1;
+    ip += mlen;
+    anchor = ip;
+  }
+  if((op = lzseq(op, oend, anchor, end - anchor, 0, 0)) == 0)
+    return -1;
+  return op - dst;
+}
+
+// Decompress the n bytes at src into at most max bytes at dst.
+// Returns the decompressed length, or -1 if src is not valid.
+int
+lzdecompress(uchar *src, int n, uchar *dst, int max)
+{
+  uchar *ip = src, *iend = src + n;
+  uchar *op = dst, *oend = dst + max;
+  uchar *ref;
+  int t, len, b;
+
+  while(ip < iend){
+    t = *ip++;
+    len = t >> 4;
+    if(len == 15){
+      do {
+        if(ip == iend)
+          return -1;
+        b = *ip++;
+        len += b;
+      } while(b == 255);
+    }
+    if(len > iend - ip || len > oend - op)
+      return -1;
+    memmove(op, ip, len);
+    op += len;
+    ip += len;
+    if(ip == iend)
+      break;
+
+    if(iend - ip < 2)
+      return -1;
+    ref = op - (ip[0] | ip[1] << 8);
+    ip += 2;
+    len = t & 15;
+    if(len == 15){
+      do {
+        if(ip == iend)
+          return -1;
+        b = *ip++;
+        len += b;
+      } while(b == 255);
+    }
+    len += LZMINMATCH;
+    if(ref >= op || ref < dst || len > oend - op)
+      return -1;
+    // the match may overlap what it produces.
+    while(len-- > 0)
+      *op++ = *ref++;
+  }
+  return op - dst;
+}
@@ -17,6 +17,7 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // kernel object allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -26,7 +27,10 @@ main()
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
+    pcinit();        // page cache
+    ksminit();       // same-page merging
     fileinit();      // file table
+    pipeinit();      // pipe allocator
     vmalistinit();   // vma table
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
@@ -0,0 +1,26 @@
+#define NORDER 11  // buddy orders 0..NORDER-1; largest block is 4MB
+
+// Physical memory statistics, filled in by the memstat() system call.
+struct memstat {
+  uint64 npages;          // pages managed by the allocator
+  uint64 nfree;           // free pages, buddy lists plus per-CPU lists
+  uint64 nfreecpu;        // free pages cached on per-CPU lists
+  uint64 nblocks[NORDER]; // free buddy blocks of each order
+  uint64 nslab;           // pages held by slab caches
+  uint64 nzero;           // free pages in the pre-zeroed pool
+  uint64 nzeromap;        // user mappings of the shared zero page
+  uint64 npcache;         // pages in the page cache
+  uint64 nreclaim;        // pages reclaimed from user mappings
+  uint64 nswap;           // swap slots, one page each
+  uint64 nswapfree;       // swap slots free
+  uint64 nswapout;        // pages written to swap
+  uint64 nswapin;         // pages read back from swap
+  uint64 nzram;           // swapped pages kept compressed in memory
+  uint64 nzrambytes;      // their compressed size
+  uint64 nzramalloc;      // bytes of memory that holds them
+  uint64 nzramhit;        // pages read back from memory, not disk
+  uint64 nzramreject;     // pages that did not compress, or found no room
+  uint64 nksmshared;      // pages that same-page merging shares
+  uint64 nksmsaved;       // pages freed by sharing them (not counting zeroes)
+  uint64 nksmmerged;      // pages ever merged, into those or the zero page
+};
@@ -0,0 +1,284 @@
+// Page cache: whole pages of file data, indexed by device,
+// inode number and page-aligned file offset.
+//
+// There is one copy of each cached page of a file, and every
+// user of the file's data goes through it:
+// * read() copies out of it (pcreadi()), and writei() updates
+//   it as well as the disk blocks (pcupdate()).
+// * MAP_SHARED mappings map it, so stores through them are seen
+//   at once by read() and by other mappings; they reach the disk
+//   when written back (see munmap()).
+// * MAP_PRIVATE mappings, and exec for a program's writable
+//   segments, map it copy-on-write; read-only segments map it
+//   directly, so all processes running one binary share it.
+//
+// The cache holds one reference (see kalloc.c) on each of its
+// pages, and every mapping of a page holds another. itrunc()
+// drops a file's pages; existing mappings keep the old contents.
+// A page some process maps is never dropped otherwise, since it
+// may hold stores not yet written back. Of the others at most
+// PCMAX are kept, the least recently used being dropped first,
+// and kalloc() drops them all when it runs out of memory.
+// When memory runs low, processes unmap pages they have not
+// used lately so that they can be dropped too (see reclaim.c).
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+#include "memstat.h"
+
+#define PCHASH 61     // hash buckets
+#define PCMAX  1024   // most pages cached
+
+struct cpage {
+  uint dev;
+  uint inum;
+  uint off;                    // page-aligned file offset
+  char *pa;
+  struct cpage *hnext;         // hash chain
+  struct cpage *next;          // LRU list, most recent first
+  struct cpage *prev;
+};
+
+struct {
+  struct spinlock lock;
+  struct slabcache *cache;
+  struct cpage *hash[PCHASH];
+  struct cpage lru;            // list head
+  int n;
+} pcache;
+
+void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.cache = slabcreate("cpage", sizeof(struct cpage));
+  pcache.lru.next = &pcache.lru;
+  pcache.lru.prev = &pcache.lru;
+}
+
+static struct cpage**
+bucket(uint dev, uint inum, uint off)
+{
+  return &pcache.hash[(dev * 31 + inum * 17 + off / PGSIZE) % PCHASH];
+}
+
+// Find a cached page. Caller holds pcache.lock.
+static struct cpage*
+lookup(uint dev, uint inum, uint off)
+{
+  struct cpage *cp;
+
+  for(cp = *bucket(dev, inum, off); cp; cp = cp->hnext)
+    if(cp->dev == dev && cp->inum == inum && cp->off == off)
+      return cp;
+  return 0;
+}
+
+static void
+lrufront(struct cpage *cp)
+{
+  cp->next = pcache.lru.next;
+  cp->prev = &pcache.lru;
+  pcache.lru.next->prev = cp;
+  pcache.lru.next = cp;
+}
+
+static void
+lruunlink(struct cpage *cp)
+{
+  cp->prev->next = cp->next;
+  cp->next->prev = cp->prev;
+}
+
+// Remove cp from the cache and drop the cache's reference
+// to its page. Caller holds pcache.lock.
+static void
+drop(struct cpage *cp)
+{
+  struct cpage **pp;
+
+  for(pp = bucket(cp->dev, cp->inum, cp->off); *pp != cp; pp = &(*pp)->hnext)
+    ;
+  *pp = cp->hnext;
+  lruunlink(cp);
+  pcache.n--;
+  putref(cp->pa);
+  slabfree(pcache.cache, cp);
+}
+
+// Drop the least recently used pages no process maps until
+// at most PCMAX remain, if possible. Caller holds pcache.lock.
+static void
+trim(void)
+{
+  struct cpage *cp, *prev;
+
+  for(cp = pcache.lru.prev; cp != &pcache.lru && pcache.n > PCMAX; cp = prev){
+    prev = cp->prev;
+    if(getref(cp->pa) == 1)
+      drop(cp);
+  }
+}
+
+// Return the cached page holding the PGSIZE bytes of ip at
+// off, reading it from the file on a miss. off must be
+// page-aligned; bytes past the end of the file read as zero.
+// The caller holds ip->lock, and gets a reference to the page
+// that it must drop with putref(). Returns 0 on failure.
+void*
+pcread(struct inode *ip, uint off)
+{
+  struct cpage *cp;
+  char *mem;
+  int n;
+
+  acquire(&pcache.lock);
+  if((cp = lookup(ip->dev, ip->inum, off)) != 0){
+    incref(cp->pa);
+    lruunlink(cp);
+    lrufront(cp);
+    release(&pcache.lock);
+    return cp->pa;
+  }
+  release(&pcache.lock);
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  if((cp = slaballoc(pcache.cache)) == 0){
+    kfree(mem);
+    return 0;
+  }
+  if((n = readi(ip, 0, (uint64)mem, off, PGSIZE)) < 0){
+    slabfree(pcache.cache, cp);
+    kfree(mem);
+    return 0;
+  }
+  memset(mem + n, 0, PGSIZE - n);
+  cp->dev = ip->dev;
+  cp->inum = ip->inum;
+  cp->off = off;
+  cp->pa = mem;
+
+  // holding ip->lock, nobody else can have added this page.
+  acquire(&pcache.lock);
+  cp->hnext = *bucket(cp->dev, cp->inum, off);
+  *bucket(cp->dev, cp->inum, off) = cp;
+  lrufront(cp);
+  pcache.n++;
+  incref(mem);
+  trim();
+  release(&pcache.lock);
+  return mem;
+}
+
+// Read n bytes of regular file ip at off into dst, like
+// readi(), but from the page cache. Caller holds ip->lock.
+// If user_dst==1, then dst is a user virtual address;
+// otherwise, dst is a kernel address.
+int
+pcreadi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m;
+  char *pa;
+  int r;
+
+  if(off > ip->size || off + n < off)
+    return 0;
+  if(off + n > ip->size)
+    n = ip->size - off;
+
+  for(tot = 0; tot < n; tot += m, off += m, dst += m){
+    if((pa = pcread(ip, PGROUNDDOWN(off))) == 0)
+      break;
+    m = n - tot;
+    if(m > PGSIZE - off % PGSIZE)
+      m = PGSIZE - off % PGSIZE;
+    r = either_copyout(user_dst, dst, pa + off % PGSIZE, m);
+    putref(pa);
+    if(r == -1){
+      tot = -1;
+      break;
+    }
+  }
+  return tot;
+}
+
+// writei() has put the n bytes at src into ip at off: copy
+// them into the cached page, if any. The bytes must lie
+// within one page. Caller holds ip->lock.
+void
+pcupdate(struct inode *ip, uint off, void *src, uint n)
+{
+  struct cpage *cp;
+
+  acquire(&pcache.lock);
+  if((cp = lookup(ip->dev, ip->inum, PGROUNDDOWN(off))) != 0)
+    memmove(cp->pa + off % PGSIZE, src, n);
+  release(&pcache.lock);
+}
+
+// Drop every cached page of ip, including any past its size
+// (a mapping may have faulted one in). Caller holds ip->lock.
+void
+pcinval(struct inode *ip)
+{
+  struct cpage *cp, *next;
+
+  acquire(&pcache.lock);
+  for(cp = pcache.lru.next; cp != &pcache.lru; cp = next){
+    next = cp->next;
+    if(cp->dev == ip->dev && cp->inum == ip->inum)
+      drop(cp);
+  }
+  release(&pcache.lock);
+}
+
+// Return the cached page holding ip's data at off, or 0 if
+// there is none. No reference is taken: the result is only
+// good for telling whether a mapped page is the cache's own.
+void*
+pcpeek(struct inode *ip, uint off)
+{
+  struct cpage *cp;
+  char *pa = 0;
+
+  acquire(&pcache.lock);
+  if((cp = lookup(ip->dev, ip->inum, off)) != 0)
+    pa = cp->pa;
+  release(&pcache.lock);
+  return pa;
+}
+
+// Drop every cached page that no process maps. Called by
+// kalloc() when memory runs out. Returns the number of pages
+// freed.
+int
+pcreap(void)
+{
+  struct cpage *cp, *prev;
+  int freed = 0;
+
+  acquire(&pcache.lock);
+  for(cp = pcache.lru.prev; cp != &pcache.lru; cp = prev){
+    prev = cp->prev;
+    if(getref(cp->pa) == 1){
+      drop(cp);
+      freed++;
+    }
+  }
+  release(&pcache.lock);
+  return freed;
+}
+
+void
+pcstat(struct memstat *st)
+{
+  st->npcache = pcache.n;
+}
@@ -9,6 +9,7 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "spawn.h"
 
 struct cpu cpus[NCPU];
 
@@ -19,12 +20,8 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
-struct {
-  struct spinlock lock;
-  struct vma vmas[VMA_MAX];
-} vma_listP;
-
 extern void forkret(void);
+static void kthreadstart(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -170,9 +167,23 @@ freeproc(struct proc *p)
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  // the files of any vmas left here hold no references yet;
+  // see fork().
+  struct vma *v;
+  while((v = vmafirst(p)) != 0){
+    vmaremove(p, v);
+    vmafree(v);
+  }
+  p->nseg = 0;
+  p->kfn = 0;
+  p->reclaim = 0;
+  p->clockhand = 0;
+  p->ksm = 0;
+  p->ksmhand = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
+  p->vfparent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
@@ -258,13 +269,44 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->vmas = 0;
   p->state = RUNNABLE;
 
   release(&p->lock);
 }
 
+// Start a kernel thread that runs fn, which must not return.
+// It takes a process slot but has no user memory, and never
+// leaves the kernel.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadstart.
+static void
+kthreadstart(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthread returned");
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; vmfault() allocates each page
+// when it is first touched.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -272,13 +314,19 @@ growproc(int n)
   uint64 sz;
   struct proc *p = myproc();
 
+  // a vfork() child's memory is its parent's.
+  if(p->vfparent)
+    return -1;
+
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // the heap must not run into the mmap area.
+    if(sz + n > START_ADDRESS)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    segtrim(p, sz);
   }
   p->sz = sz;
   return 0;
@@ -306,6 +354,40 @@ fork(void)
   }
   np->sz = p->sz;
 
+  // Copy the parent's mappings. Take the file references
+  // only once every vma has been allocated, so that failure
+  // has nothing to close.
+  struct vma *v, *nv;
+  for(v = vmafirst(p); v; v = vmanext(p, v)){
+    if((nv = vmaalloc()) == 0){
+      freeproc(np);
+      release(&np->lock);
+      return -1;
+    }
+    *nv = *v;
+    nv->vm_locked = 0;  // locks are not inherited
+    vmainsert(np, nv);
+  }
+  // the child starts with the pages the parent has mapped:
+  // those of MAP_SHARED mappings shared outright, the others
+  // copy-on-write, as for the rest of the parent's memory.
+  for(v = vmafirst(p); v; v = vmanext(p, v)){
+    if(v->vm_flags == MAP_SHARED)
+      i = uvmshare(p->pagetable, np->pagetable, v->vm_start, v->vm_end);
+    else
+      i = uvmcopyrange(p->pagetable, np->pagetable, v->vm_start, v->vm_end);
+    if(i < 0){
+      for(v = vmafirst(p); v; v = vmanext(p, v))
+        uvmunmap(np->pagetable, v->vm_start, (v->vm_end - v->vm_start) / PGSIZE, 1);
+      freeproc(np);
+      release(&np->lock);
+      return -1;
+    }
+  }
+  for(v = vmafirst(np); v; v = vmanext(np, v))
+    if(v->vm_file)
+      filedup(v->vm_file);
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -317,57 +399,174 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exe)
+    np->exe = idup(p->exe);
+  memmove(np->segs, p->segs, sizeof(p->segs));
+  np->nseg = p->nseg;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
-  //copiar las vmas del padre e incrementar las referencias de los ficheros
-  np->vmas = p->vmas;
-  struct vma *actual = p->vmas;
-  int index = -1;
-  int cont = 0;
+  release(&np->lock);
 
-  acquire(&vma_listP.lock);
-  for(i = 0;i<p->numVmas;i++)
-  {
-    //buscamos una vma libre
-    while(cont < VMA_MAX && cont != index)
-    {
-      if(vma_listP.vmas[cont].use == 0)
-      {
-        if(i == 0) np->vmas = &vma_listP.vmas[cont];
-        else vma_listP.vmas[index].vm_next = &vma_listP.vmas[cont];
-
-        vma_listP.vmas[cont].vm_start = actual->vm_start;
-        vma_listP.vmas[cont].vm_offset = actual->vm_offset;
-        vma_listP.vmas[cont].vm_end = actual->vm_end;
-        vma_listP.vmas[cont].vm_flags = actual->vm_flags;
-        vma_listP.vmas[cont].vm_prot = actual->vm_prot;
-        vma_listP.vmas[cont].vm_ref = 0;
-        vma_listP.vmas[cont].vm_firstDir = actual->vm_firstDir;
-        vma_listP.vmas[cont].vm_next = 0;
-        vma_listP.vmas[cont].vm_file = actual->vm_file;
-        vma_listP.vmas[cont].vm_file->ref++; 
-        vma_listP.vmas[cont].use = 1;
-        index = cont;
-
-      }else if(cont == VMA_MAX-1){
-        release(&vma_listP.lock);
-        release(&np->lock);
-        return -1;  //No hay vmas
-      }else cont++;
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a new process that shares the parent's memory, page
+// table pages included, until it calls exec() or exits; the
+// parent waits until then. Nothing is copied, so the child
+// should do little more than call exec(): calls that change
+// the size or layout of its address space fail.
+int
+vfork(void)
+{
+  int i, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if(p->vfparent)
+    return -1;
+
+  // Allocate process.
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+
+  uvmborrow(p->pagetable, np->pagetable);
+  np->sz = p->sz;
+
+  // copy saved user registers.
+  *(np->trapframe) = *(p->trapframe);
+
+  // Cause vfork to return 0 in the child.
+  np->trapframe->a0 = 0;
+
+  // increment reference counts on open file descriptors.
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+  if(p->exe)
+    np->exe = idup(p->exe);
+  memmove(np->segs, p->segs, sizeof(p->segs));
+  np->nseg = p->nseg;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  np->vfparent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  // np cannot be freed while we wait: only we can reap it.
+  acquire(&wait_lock);
+  while(np->vfparent == p)
+    sleep(np, &wait_lock);
+  release(&wait_lock);
+
+  return pid;
+}
+
+// Give the memory a vfork() child borrowed back to its
+// parent and let the parent run. Called by the child, from
+// exec() once the new image is ready, or from exit().
+void
+vforkdone(struct proc *p)
+{
+  uvmunborrow(p->vfparent->pagetable, p->pagetable);
+  p->sz = 0;
+
+  acquire(&wait_lock);
+  p->vfparent = 0;
+  wakeup(p);
+  release(&wait_lock);
+}
+
+// Apply one spawn() file action to np's descriptors.
+static int
+spawnfile(struct proc *np, struct spawnact *a)
+{
+  struct file *f;
+
+  if(a->fd < 0 || a->fd >= NOFILE || np->ofile[a->fd] == 0)
+    return -1;
+  switch(a->op){
+  case SPAWN_CLOSE:
+    fileclose(np->ofile[a->fd]);
+    np->ofile[a->fd] = 0;
+    return 0;
+  case SPAWN_DUP2:
+    if(a->newfd < 0 || a->newfd >= NOFILE)
+      return -1;
+    if(a->newfd != a->fd){
+      f = filedup(np->ofile[a->fd]);
+      if(np->ofile[a->newfd])
+        fileclose(np->ofile[a->newfd]);
+      np->ofile[a->newfd] = f;
     }
-    cont++;
-    actual = actual->vm_next;        
+    return 0;
   }
+  return -1;
+}
 
-  release(&vma_listP.lock);
+// Create a new process running the program at path with
+// arguments argv, loading it directly rather than copying
+// this process first. The child starts with a copy of the
+// parent's file descriptors, to which the nact actions in
+// act are applied in order.
+// Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct spawnact *act, int nact)
+{
+  int i, pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  // Allocate process.
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+
+  // closing files and loading the program may sleep, so
+  // drop np->lock; nothing else touches np until it is
+  // RUNNABLE.
   release(&np->lock);
 
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+
+  for(i = 0; i < nact; i++)
+    if(spawnfile(np, &act[i]) < 0)
+      goto bad;
+
+  if((argc = execinto(np, path, argv)) < 0)
+    goto bad;
+  np->trapframe->a0 = argc;
+
+  pid = np->pid;
+
   acquire(&wait_lock);
   np->parent = p;
-  np->numVmas = p->numVmas;
   release(&wait_lock);
 
   acquire(&np->lock);
@@ -375,6 +574,22 @@ fork(void)
   release(&np->lock);
 
   return pid;
+
+ bad:
+  for(i = 0; i < NOFILE; i++){
+    if(np->ofile[i]){
+      fileclose(np->ofile[i]);
+      np->ofile[i] = 0;
+    }
+  }
+  begin_op();
+  iput(np->cwd);
+  end_op();
+  np->cwd = 0;
+  acquire(&np->lock);
+  freeproc(np);
+  release(&np->lock);
+  return -1;
 }
 
 // Pass p's abandoned children to init.
@@ -403,6 +618,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  if(p->vfparent)
+    vforkdone(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -413,17 +631,19 @@ exit(int status)
   }
 
   //desmapear vmas;
-  struct vma *actual = p->vmas;
-  while( p->numVmas > 0 )
+  struct vma *actual;
+  while((actual = vmafirst(p)) != 0)
   {
-    actual = p->vmas;
     munmap((void *)actual->vm_start, actual->vm_end - actual->vm_start); //control de fallo
   }
 
   begin_op();
   iput(p->cwd);
+  if(p->exe)
+    iput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
 
   acquire(&wait_lock);
 
@@ -454,6 +674,11 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the status is copied out with locks held.
+  if(addr != 0)
+    uvmprefault(addr, sizeof(int), 1);
+
+again:
   acquire(&wait_lock);
 
   for(;;){
@@ -472,6 +697,9 @@ wait(uint64 addr)
                                   sizeof(pp->xstate)) < 0) {
             release(&pp->lock);
             release(&wait_lock);
+            // fault the page in without the locks, and look again.
+            if(copyfault(1) == 0)
+              goto again;
             return -1;
           }
           freeproc(pp);
@@ -512,6 +740,7 @@ scheduler(void)
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
+    int found = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
       if(p->state == RUNNABLE) {
@@ -525,9 +754,14 @@ scheduler(void)
         // Process is done running for now.
         // It should have changed its p->state before coming back.
         c->proc = 0;
+        found = 1;
       }
       release(&p->lock);
     }
+
+    // Nothing to run: use the idle time to zero free pages.
+    if(!found)
+      kzeroidle();
   }
 }
 
@@ -585,6 +819,10 @@ forkret(void)
     // be run from main().
     first = 0;
     fsinit(ROOTDEV);
+    kthread(writeback, "writeback");
+    kthread(readahead, "readahead");
+    kthread(reclaimer, "reclaim");
+    kthread(ksmscanner, "ksm");
   }
 
   usertrapret();
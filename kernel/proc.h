@@ -81,7 +81,16 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
-#define VMA_PROCESS 4
+// A loadable segment of the program a process runs. Its
+// pages are read from the program file when first touched.
+struct seg {
+  uint64 va;                   // page-aligned start
+  uint64 filesz;               // bytes from va that come from the file
+  uint64 off;                  // file offset of va
+  int perm;                    // PTE_W and/or PTE_X
+};
+
+#define NSEG 4                 // segments tracked; more are loaded by exec
 
 
 // Per-process state
@@ -94,9 +103,12 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int reclaim;                 // Pages the reclaim thread asks back
+  int ksm;                     // Pages the ksm thread asks to look at
 
-  // wait_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *vfparent;       // Parent whose memory a vfork() child borrows
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -106,9 +118,17 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Program file, for segfault()
+  struct seg segs[NSEG];       // Segments of exe not yet all loaded
+  int nseg;
+  void (*kfn)(void);           // What a kernel thread runs
   char name[16];               // Process name (debugging)
+  int nsleep;                  // Sleep-locks held
+  int copyfault;               // A locked copy left faultva unfaulted
+  uint64 faultva;              // (see uvmaccess())
 
-  struct vma * vmas;
-  int numVmas;
-  void * lastDirVma;
+  struct vma *vmaroot;          // Mappings, by address (see vma.c)
+  struct vma *vmahint;          // Last mapping looked up
+  uint64 clockhand;             // Where vmreclaim() looks next
+  uint64 ksmhand;               // Where ksmself() looks next
 };
@@ -0,0 +1,147 @@
+// Page reclaim.
+//
+// kalloc() notes when free memory runs low (see kmemlow()).
+// The reclaim thread then asks the processes, a few at a time
+// in turn, to give back pages: each does so on its next way
+// back to user space (reclaimself(), called by usertrap()),
+// with a clock over its pages (vmreclaim() in file.c), which
+// drops file pages and writes anonymous ones to swap (swap.c).
+// A process unmaps its own pages because only it can know that
+// no TLB holds them: xv6 has no way to flush another CPU's.
+// Once unmapped, file pages are held by the page cache alone,
+// and the thread frees them with pcreap(); it goes on until
+// kmemlow() clears.
+//
+// A page fault that fails for want of memory waits for a
+// round of this and is tried again (reclaimfault()), so that
+// a process that needs more memory slows down, and is killed
+// only if nothing can be reclaimed.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "memstat.h"
+
+#define RECLAIMBATCH 32  // pages a process is asked for
+#define RECLAIMPROCS 4   // processes asked per round
+#define RECLAIMTRIES 4   // rounds a failed page fault waits for
+#define RECLAIMSCANS 16  // vmreclaim() calls a failed fault makes
+
+extern struct proc proc[NPROC];
+
+static uint64 nreclaim;  // pages unmapped by vmreclaim()
+
+static void
+ticksleep(int n)
+{
+  uint t0;
+
+  acquire(&tickslock);
+  t0 = ticks;
+  while(ticks - t0 < n)
+    sleep(&ticks, &tickslock);
+  release(&tickslock);
+}
+
+static int
+reclaimfrom(struct proc *p, int n)
+{
+  n = vmreclaim(p, n);
+  __sync_fetch_and_add(&nreclaim, n);
+  return n;
+}
+
+// Body of the reclaim kernel thread.
+void
+reclaimer(void)
+{
+  struct proc *p, *hand = proc;
+  int i, asked;
+
+  for(;;){
+    acquire(&tickslock);
+    while(!kmemlow())
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    for(i = 0, asked = 0; i < NPROC && asked < RECLAIMPROCS; i++){
+      p = hand;
+      if(++hand == &proc[NPROC])
+        hand = proc;
+      acquire(&p->lock);
+      if(p->state != UNUSED && p->state != ZOMBIE && p->kfn == 0 &&
+         p->reclaim == 0){
+        p->reclaim = RECLAIMBATCH;
+        asked++;
+      }
+      release(&p->lock);
+    }
+
+    // a running process answers within a tick, at its next
+    // timer interrupt.
+    ticksleep(2);
+    pcreap();
+    slabreap();
+  }
+}
+
+// Give back the pages the reclaim thread asked p for, if
+// memory is still low. p is the current process.
+void
+reclaimself(struct proc *p)
+{
+  int n;
+
+  acquire(&p->lock);
+  n = p->reclaim;
+  p->reclaim = 0;
+  release(&p->lock);
+  if(n && kmemlow())
+    reclaimfrom(p, n);
+}
+
+// Handle a page fault of p like vmfault(), but if it fails
+// because kalloc() found no page, give back some of p's own
+// pages, wait for the other processes to give back theirs,
+// and try again, up to RECLAIMTRIES times. Returns 0, or -1.
+int
+reclaimfault(struct proc *p, uint64 va, int write)
+{
+  uint nfail;
+  uint64 before;
+  int i, j, got;
+
+  for(i = 0; ; i++){
+    nfail = kallocfails();
+    if(vmfault(p, va, write) == 0)
+      return 0;
+    if(kallocfails() == nfail || i == RECLAIMTRIES || killed(p))
+      return -1;
+
+    // the first calls may only find pages used lately, and
+    // clear their accessed bits.
+    before = knfree();
+    got = 0;
+    for(j = 0; j < RECLAIMSCANS && got == 0; j++)
+      got = reclaimfrom(p, RECLAIMBATCH);
+    if(got > 0){
+      // our anonymous pages are free once written to swap.
+      swapsync();
+    } else {
+      ticksleep(2);
+    }
+    got += pcreap() + slabreap();
+    if(got == 0 && knfree() <= before)
+      return -1;
+  }
+}
+
+void
+reclaimstat(struct memstat *st)
+{
+  st->nreclaim = nreclaim;
+}
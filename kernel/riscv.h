@@ -343,7 +343,10 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_A (1L << 6) // pagina accedida
 #define PTE_D (1L << 7) // pagina sucia
+#define PTE_COW (1L << 8) // copy-on-write (RSW bit, ignored by hardware)
+#define PTE_SWAP (1L << 9) // page out on swap, in a pte without PTE_V (RSW bit)
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -352,6 +355,10 @@ typedef uint64 *pagetable_t; // 512 PTEs
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// the swap slot of a PTE_SWAP pte, where the page number goes.
+#define PTE2SLOT(pte) ((pte) >> 10)
+#define SLOT2PTE(s) (((uint64)(s)) << 10)
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
@@ -0,0 +1,327 @@
+// Slab allocator for small kernel objects.
+//
+// A slab is one page from kalloc(), headed by a struct slab and
+// carved into equal-sized objects. Each cache keeps its slabs
+// that still have free objects on a list, plus a small per-CPU
+// stack of free objects so that most slaballoc() and slabfree()
+// calls touch only the current CPU's lock.
+//
+// kmalloc() serves variable-sized requests from power-of-two
+// caches up to KMALLOC_MAX bytes, and from kallocpages() above.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "memstat.h"
+
+#define NSLABCACHE  24   // maximum number of caches
+#define SLAB_MAG    16   // free objects cached per CPU
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 1024
+
+struct slab {
+  struct slabcache *sc;
+  struct slab *next;       // on sc->partial
+  struct slab *prev;
+  void *free;              // free objects, linked through their first word
+  int inuse;               // allocated objects, including per-CPU cached ones
+};
+
+// the slab holding object obj.
+#define SLAB(obj) ((struct slab*)PGROUNDDOWN((uint64)(obj)))
+#define SLABHDR   ((sizeof(struct slab) + 7) & ~7)
+
+struct slabcpu {
+  struct spinlock lock;
+  int n;
+  void *obj[SLAB_MAG];
+};
+
+struct slabcache {
+  char *name;
+  uint size;               // object size, a multiple of 8
+  int perslab;             // objects per slab
+  struct spinlock lock;    // protects partial, nslabs and the slabs' free lists
+  struct slab *partial;    // slabs with at least one free object
+  int nslabs;
+  struct slabcpu cpu[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  int n;
+  struct slabcache caches[NSLABCACHE];
+  struct slabcache *kmalloc[8];   // 16, 32, ..., KMALLOC_MAX bytes
+  uchar bigorder[MAXPAGES];       // kallocpages() order of large kmalloc()s
+} slabs;
+
+// Create a cache of objects of the given size.
+// Caches are never destroyed.
+struct slabcache*
+slabcreate(char *name, uint size)
+{
+  struct slabcache *sc;
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(void*) || size > PGSIZE - SLABHDR)
+    panic("slabcreate: size");
+
+  acquire(&slabs.lock);
+  if(slabs.n == NSLABCACHE)
+    panic("slabcreate: too many caches");
+  sc = &slabs.caches[slabs.n++];
+  release(&slabs.lock);
+
+  sc->name = name;
+  sc->size = size;
+  sc->perslab = (PGSIZE - SLABHDR) / size;
+  initlock(&sc->lock, "slab");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&sc->cpu[i].lock, "slabcpu");
+  return sc;
+}
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+  for(int i = 0; (KMALLOC_MIN << i) <= KMALLOC_MAX; i++)
+    slabs.kmalloc[i] = slabcreate("kmalloc", KMALLOC_MIN << i);
+}
+
+static void
+unlinkslab(struct slabcache *sc, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    sc->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+static void
+pushslab(struct slabcache *sc, struct slab *s)
+{
+  s->prev = 0;
+  s->next = sc->partial;
+  if(sc->partial)
+    sc->partial->prev = s;
+  sc->partial = s;
+}
+
+// Make a new slab for sc. Called without sc->lock held,
+// since kalloc() may call slabreap().
+static struct slab*
+newslab(struct slabcache *sc)
+{
+  struct slab *s;
+  char *o;
+
+  if((s = kalloc()) == 0)
+    return 0;
+  s->sc = sc;
+  s->inuse = 0;
+  s->free = 0;
+  for(int i = sc->perslab - 1; i >= 0; i--){
+    o = (char*)s + SLABHDR + i*sc->size;
+    *(void**)o = s->free;
+    s->free = o;
+  }
+  return s;
+}
+
+// Take up to n free objects from sc's slabs, growing the
+// cache by a slab if none are free. Returns the number taken.
+static int
+slabget(struct slabcache *sc, void **obj, int n)
+{
+  struct slab *s;
+  int i = 0;
+
+  acquire(&sc->lock);
+  while(i < n){
+    if((s = sc->partial) == 0){
+      if(i > 0)
+        break;
+      release(&sc->lock);
+      if((s = newslab(sc)) == 0)
+        return 0;
+      acquire(&sc->lock);
+      pushslab(sc, s);
+      sc->nslabs++;
+    }
+    obj[i++] = s->free;
+    s->free = *(void**)s->free;
+    s->inuse++;
+    if(s->free == 0)
+      unlinkslab(sc, s);
+  }
+  release(&sc->lock);
+  return i;
+}
+
+// Return n objects to their slabs, and free any slab that
+// becomes empty. Returns the number of pages freed.
+static int
+slabput(struct slabcache *sc, void **obj, int n)
+{
+  struct slab *s, *empty = 0;
+  int freed = 0;
+
+  acquire(&sc->lock);
+  for(int i = 0; i < n; i++){
+    s = SLAB(obj[i]);
+    if(s->sc != sc)
+      panic("slabput: wrong cache");
+    if(s->free == 0)
+      pushslab(sc, s);   // was full
+    *(void**)obj[i] = s->free;
+    s->free = obj[i];
+    if(--s->inuse == 0){
+      unlinkslab(sc, s);
+      sc->nslabs--;
+      s->next = empty;
+      empty = s;
+    }
+  }
+  release(&sc->lock);
+
+  while(empty){
+    s = empty;
+    empty = s->next;
+    kfree(s);
+    freed++;
+  }
+  return freed;
+}
+
+// Allocate an object from sc. Returns 0 if out of memory.
+// The object's contents are undefined.
+void*
+slaballoc(struct slabcache *sc)
+{
+  void *batch[SLAB_MAG/2];
+  struct slabcpu *c;
+  void *obj = 0;
+  int n;
+
+  push_off();
+  c = &sc->cpu[cpuid()];
+  acquire(&c->lock);
+  if(c->n > 0)
+    obj = c->obj[--c->n];
+  release(&c->lock);
+  pop_off();
+  if(obj)
+    return obj;
+
+  // refill this CPU's stack from the slabs.
+  if((n = slabget(sc, batch, SLAB_MAG/2)) == 0)
+    return 0;
+  obj = batch[--n];
+  push_off();
+  c = &sc->cpu[cpuid()];
+  acquire(&c->lock);
+  while(n > 0 && c->n < SLAB_MAG)
+    c->obj[c->n++] = batch[--n];
+  release(&c->lock);
+  pop_off();
+  if(n > 0)
+    slabput(sc, batch, n);
+  return obj;
+}
+
+// Free an object allocated from sc.
+void
+slabfree(struct slabcache *sc, void *obj)
+{
+  void *batch[SLAB_MAG/2 + 1];
+  struct slabcpu *c;
+  int n = 0;
+
+  push_off();
+  c = &sc->cpu[cpuid()];
+  acquire(&c->lock);
+  if(c->n < SLAB_MAG){
+    c->obj[c->n++] = obj;
+  } else {
+    // spill half of this CPU's stack back to the slabs.
+    batch[n++] = obj;
+    while(n <= SLAB_MAG/2)
+      batch[n++] = c->obj[--c->n];
+  }
+  release(&c->lock);
+  pop_off();
+  if(n > 0)
+    slabput(sc, batch, n);
+}
+
+// Flush every per-CPU stack back to its slabs and free the
+// slabs that become empty. Called by kalloc() when memory runs
+// out. Returns the number of pages freed.
+int
+slabreap(void)
+{
+  void *batch[SLAB_MAG];
+  struct slabcache *sc;
+  struct slabcpu *c;
+  int n, freed = 0;
+
+  for(sc = slabs.caches; sc < slabs.caches + slabs.n; sc++){
+    for(c = sc->cpu; c < sc->cpu + NCPU; c++){
+      acquire(&c->lock);
+      n = c->n;
+      memmove(batch, c->obj, n * sizeof(void*));
+      c->n = 0;
+      release(&c->lock);
+      if(n > 0)
+        freed += slabput(sc, batch, n);
+    }
+  }
+  return freed;
+}
+
+// Allocate n bytes of kernel memory.
+// Returns 0 if out of memory.
+void*
+kmalloc(uint n)
+{
+  char *pa;
+  int i, order;
+
+  if(n <= KMALLOC_MAX){
+    for(i = 0; (KMALLOC_MIN << i) < n; i++)
+      ;
+    return slaballoc(slabs.kmalloc[i]);
+  }
+
+  for(order = 0; (PGSIZE << order) < n; order++)
+    ;
+  if((pa = kallocpages(order)) == 0)
+    return 0;
+  slabs.bigorder[PA2PG(pa)] = order;
+  return pa;
+}
+
+// Free memory returned by kmalloc(). Slab objects are never
+// page-aligned, since each slab starts with its header.
+void
+kmfree(void *p)
+{
+  if(((uint64)p % PGSIZE) == 0)
+    kfreepages(p, slabs.bigorder[PA2PG(p)]);
+  else
+    slabfree(SLAB(p)->sc, p);
+}
+
+// Count the pages held by slab caches.
+void
+slabstat(struct memstat *st)
+{
+  for(int i = 0; i < slabs.n; i++)
+    st->nslab += slabs.caches[i].nslabs;
+}
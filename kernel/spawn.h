@@ -0,0 +1,11 @@
+// File actions for spawn(), applied in order to the child's
+// copy of the parent's file descriptor table.
+#define SPAWN_CLOSE  1   // close fd
+#define SPAWN_DUP2   2   // make newfd refer to fd's file, like dup2()
+#define SPAWN_MAXACT 16  // most actions one spawn() accepts
+
+struct spawnact {
+  int op;
+  int fd;
+  int newfd;
+};
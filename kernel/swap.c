@@ -0,0 +1,214 @@
+// Swap space, for the anonymous pages that reclaim takes from
+// processes (see vmreclaim() in file.c): pages of the heap,
+// stack and BSS, of anonymous mappings, and private copies of
+// file pages, which no file holds.
+//
+// The swap area is the sb.nswap blocks of the disk after the
+// file system, which mkfs reserves, divided into page-sized
+// slots. A page on swap is recorded in its pte, with PTE_V
+// clear: PTE_SWAP set, the slot where the physical page number
+// goes, and the page's permission bits. A fault on the page
+// reads it back (swapin()). fork() copies such ptes, so a slot
+// has a reference count, as a page does.
+//
+// Pages are written out asynchronously: swapwrite() starts the
+// write, and the page is freed when the interrupt says it is
+// done. Until then the slot remembers the page, and a fault on
+// it takes the page back without reading the disk. A page that
+// compresses well is kept in memory instead (zram.c), and the
+// disk is not written at all.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "memstat.h"
+
+#define SLOTBLOCKS (PGSIZE/BSIZE)   // disk blocks per slot
+#define NSLOT (SWAPSIZE/SLOTBLOCKS)
+
+struct {
+  struct spinlock lock;
+  uint start;           // first block of the swap area
+  int nslot;            // slots the disk has room for
+  int nfree;
+  int nbusy;            // writes in flight
+  int hand;             // where swapalloc() looks next
+  uchar ref[NSLOT];     // ptes that refer to each slot
+  char *busy[NSLOT];    // page being written to each slot
+  void *zram[NSLOT];    // compressed page held for each slot
+  uint64 nout;          // pages written out
+  uint64 nin;           // pages read back
+} swap;
+
+// Set up the swap area that the super block sb describes.
+void
+swapinit(struct superblock *sb)
+{
+  initlock(&swap.lock, "swap");
+  swap.start = sb->swapstart;
+  swap.nslot = sb->nswap / SLOTBLOCKS;
+  if(swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+  swap.nfree = swap.nslot;
+  zraminit();
+}
+
+// Give the page at pa, which its caller is about to replace
+// with a swap pte, a free slot; the slot takes over the pte's
+// reference to the page until swapwrite() has written it.
+// Returns the slot, or -1 if swap is full. Does not sleep.
+int
+swapalloc(char *pa)
+{
+  int i, s;
+
+  acquire(&swap.lock);
+  for(i = 0; i < swap.nslot; i++){
+    s = (swap.hand + i) % swap.nslot;
+    if(swap.ref[s] == 0 && swap.busy[s] == 0){
+      swap.ref[s] = 1;
+      swap.busy[s] = pa;
+      swap.nfree--;
+      swap.nbusy++;
+      swap.hand = s + 1;
+      release(&swap.lock);
+      return s;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Called by the disk interrupt when a swapwrite() is done.
+static void
+swapdone(char *pa, uint blockno)
+{
+  int s = (blockno - swap.start) / SLOTBLOCKS;
+  int n;
+
+  acquire(&swap.lock);
+  swap.busy[s] = 0;
+  n = --swap.nbusy;
+  release(&swap.lock);
+  // not holding swap.lock, which vmreclaim() takes inside
+  // a p->lock.
+  if(n == 0)
+    wakeup(&swap.nbusy);
+  putref(pa);
+}
+
+// Start writing the page swapalloc() gave slot s, and return;
+// the page is freed once the write is done. May sleep.
+void
+swapwrite(int s)
+{
+  char *pa = swap.busy[s];
+  void *z;
+  int n;
+
+  __sync_fetch_and_add(&swap.nout, 1);
+  if((z = zramstore(pa)) == 0){
+    virtio_disk_page(pa, swap.start + s*SLOTBLOCKS, 1, swapdone);
+    return;
+  }
+  acquire(&swap.lock);
+  swap.zram[s] = z;
+  swap.busy[s] = 0;
+  n = --swap.nbusy;
+  release(&swap.lock);
+  if(n == 0)
+    wakeup(&swap.nbusy);
+  putref(pa);
+}
+
+// Wait for the swap writes in flight to finish.
+void
+swapsync(void)
+{
+  acquire(&swap.lock);
+  while(swap.nbusy)
+    sleep(&swap.nbusy, &swap.lock);
+  release(&swap.lock);
+}
+
+// Add a reference to slot s, for a copy of a pte.
+void
+swapdup(int s)
+{
+  acquire(&swap.lock);
+  if(swap.ref[s] == 0)
+    panic("swapdup");
+  swap.ref[s]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot s.
+void
+swapfree(int s)
+{
+  void *z = 0;
+
+  acquire(&swap.lock);
+  if(swap.ref[s] == 0)
+    panic("swapfree");
+  if(--swap.ref[s] == 0){
+    z = swap.zram[s];
+    swap.zram[s] = 0;
+    swap.nfree++;
+  }
+  release(&swap.lock);
+  if(z)
+    zramfree(z);
+}
+
+// Bring back the page that the swap pte *pte records, and
+// map it there. Pages another pte still refers to are read
+// into a copy of the process's own. Returns 0, or -1 if no
+// memory can be had.
+int
+swapin(pte_t *pte)
+{
+  int s = PTE2SLOT(*pte);
+  uint flags = PTE_FLAGS(*pte) & ~PTE_SWAP;
+  char *mem;
+  void *z;
+
+  acquire(&swap.lock);
+  if((mem = swap.busy[s]) != 0){
+    // still being written: take the page back, to copy on a
+    // store if the write still holds it.
+    incref(mem);
+    release(&swap.lock);
+    if(flags & PTE_W)
+      flags = (flags & ~PTE_W) | PTE_COW;
+  } else {
+    // our reference keeps swap.zram[s] from changing.
+    z = swap.zram[s];
+    release(&swap.lock);
+    if((mem = kalloc()) == 0)
+      return -1;
+    if(z)
+      zramload(z, mem);
+    else
+      virtio_disk_page(mem, swap.start + s*SLOTBLOCKS, 0, 0);
+    __sync_fetch_and_add(&swap.nin, 1);
+  }
+  *pte = PA2PTE(mem) | flags | PTE_V;
+  swapfree(s);
+  return 0;
+}
+
+void
+swapstat(struct memstat *st)
+{
+  st->nswap = swap.nslot;
+  st->nswapfree = swap.nfree;
+  st->nswapout = swap.nout;
+  st->nswapin = swap.nin;
+  zramstat(st);
+}
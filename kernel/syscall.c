@@ -103,6 +103,17 @@ extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
 extern uint64 sys_mmap(void);
 extern uint64 sys_munmap(void);
+extern uint64 sys_memstat(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_vfork(void);
+extern uint64 sys_msync(void);
+extern uint64 sys_madvise(void);
+extern uint64 sys_mprotect(void);
+extern uint64 sys_mlock(void);
+extern uint64 sys_munlock(void);
+#ifdef KTEST
+extern uint64 sys_buddytest(void);
+#endif
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -130,6 +141,17 @@ static uint64 (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_mmap]    sys_mmap,
 [SYS_munmap]   sys_munmap,
+[SYS_memstat]  sys_memstat,
+[SYS_spawn]   sys_spawn,
+[SYS_vfork]   sys_vfork,
+[SYS_msync]   sys_msync,
+[SYS_madvise] sys_madvise,
+[SYS_mprotect] sys_mprotect,
+[SYS_mlock]   sys_mlock,
+[SYS_munlock] sys_munlock,
+#ifdef KTEST
+[SYS_buddytest] sys_buddytest,
+#endif
 };
 
 void
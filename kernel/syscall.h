@@ -22,3 +22,12 @@
 #define SYS_close  21
 #define SYS_mmap  22
 #define SYS_munmap  23
+#define SYS_memstat 24
+#define SYS_spawn  25
+#define SYS_vfork  26
+#define SYS_msync  27
+#define SYS_madvise 28
+#define SYS_mprotect 29
+#define SYS_mlock  30
+#define SYS_munlock 31
+#define SYS_buddytest 32  // KTEST kernels only
@@ -16,6 +16,7 @@
 #include "file.h"
 #include "fcntl.h"
 #include "vma.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -432,20 +433,26 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Free the strings fetched by fetchargv().
+static void
+freeargv(char **argv)
+{
+  for(int i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// Copy the user argument vector at uargv into argv, one
+// kernel page per string. Returns 0, or -1 having freed
+// whatever was copied.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -461,18 +468,56 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
 
-  int ret = exec(path, argv);
+ bad:
+  freeargv(argv);
+  return -1;
+}
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
 
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = exec(path, argv);
+
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct spawnact act[SPAWN_MAXACT];
+  uint64 uargv, uact;
+  int nact;
+
+  argaddr(1, &uargv);
+  argaddr(2, &uact);
+  argint(3, &nact);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  if(nact < 0 || nact > SPAWN_MAXACT)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)act, uact, nact*sizeof(act[0])) < 0)
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = spawn(path, argv, act, nact);
+
+  freeargv(argv);
+  return ret;
 }
 
 uint64
@@ -519,9 +564,10 @@ sys_mmap(void)
 
   if(prot != PROT_READ && prot != PROT_WRITE && prot != PROT_READ_WRITE)
     return (void *)-1;
-  if(flag != MAP_PRIVATE && flag != MAP_SHARED)
+  if((flag & ~MAP_POPULATE) != MAP_PRIVATE && (flag & ~MAP_POPULATE) != MAP_SHARED &&
+     (flag & ~MAP_POPULATE) != (MAP_PRIVATE|MAP_ANONYMOUS))
     return (void *)-1;
-  if(fd < 0 || fd >= NOFILE)
+  if(!(flag & MAP_ANONYMOUS) && (fd < 0 || fd >= NOFILE))
     return (void *)-1;
 
   return mmap(0, length, prot, flag, fd, offset);
@@ -537,10 +583,67 @@ sys_munmap(void)
   argaddr(0, &addr);
   argaddr(1, &length);
   
-  begin_op();
-  int e = munmap((void *)addr, length);
-  end_op();
+  return munmap((void *)addr, length);
+
+}
+
+uint64
+sys_msync(void)
+{
+  uint64 addr, length;
+  int flags;
+
+  argaddr(0, &addr);
+  argaddr(1, &length);
+  argint(2, &flags);
+
+  return msync(addr, length, flags);
+}
+
+uint64
+sys_madvise(void)
+{
+  uint64 addr, length;
+  int advice;
+
+  argaddr(0, &addr);
+  argaddr(1, &length);
+  argint(2, &advice);
+
+  return madvise(addr, length, advice);
+}
 
-  return e;
+uint64
+sys_mprotect(void)
+{
+  uint64 addr, length;
+  int prot;
+
+  argaddr(0, &addr);
+  argaddr(1, &length);
+  argint(2, &prot);
+
+  return mprotect(addr, length, prot);
+}
+
+uint64
+sys_mlock(void)
+{
+  uint64 addr, length;
+
+  argaddr(0, &addr);
+  argaddr(1, &length);
+
+  return mlock(addr, length, 1);
+}
 
-}
\ No newline at end of file
+uint64
+sys_munlock(void)
+{
+  uint64 addr, length;
+
+  argaddr(0, &addr);
+  argaddr(1, &length);
+
+  return mlock(addr, length, 0);
+}
@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "memstat.h"
 
 uint64
 sys_exit(void)
@@ -27,6 +28,12 @@ sys_fork(void)
   return fork();
 }
 
+uint64
+sys_vfork(void)
+{
+  return vfork();
+}
+
 uint64
 sys_wait(void)
 {
@@ -88,4 +95,32 @@ sys_uptime(void)
   xticks = ticks;
   release(&tickslock);
   return xticks;
-}
\ No newline at end of file
+}
+
+// report physical memory statistics.
+uint64
+sys_memstat(void)
+{
+  uint64 addr;
+  struct memstat st;
+
+  argaddr(0, &addr);
+  kmemstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+#ifdef KTEST
+// exercise the buddy allocator with mixed-order
+// allocations; see buddytest() in buddy.c.
+uint64
+sys_buddytest(void)
+{
+  int seed, n;
+
+  argint(0, &seed);
+  argint(1, &n);
+  return buddytest(seed, n);
+}
+#endif
@@ -5,10 +5,6 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
-#include "fs.h"
-#include "sleeplock.h"
-#include "file.h"
-#include "vma.h"
 
 
 struct spinlock tickslock;
@@ -38,9 +34,6 @@ trapinithart(void)
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
 //
-
-
-
 void
 usertrap(void)
 {
@@ -75,53 +68,10 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
-  }  else if(r_scause() == 13 || r_scause() == 15 || r_scause() == 12){
-    // ver que vma tiene el proceso, si la direccion esta dentro de alguno de los vma del proceso entonces le damos una pagina al proceso.
-    // si no esta dentro de ninguno de los vma del proceso entonces se mata el proceso.
-    // el tamaño del proceso no se toca, solo se le da una pagina al proceso.
+  } else if(r_scause() == 13 || r_scause() == 15 || r_scause() == 12){
     // page fault
-    // pido una pagina con kalloc
-
-    //miramos si tiene alguna vma
-    if(p->numVmas == 0){
-      p->killed = 1;
-      exit(-1);
-    }
-
-    uint64 addr = (uint64) r_stval(); //direcion causante
-    struct vma *actual = p->vmas;
-
-    //buscamos la vma que ha generando el fallo
-    int i = 0;
-    for(i = 0;i<p->numVmas;i++)
-    {
-      if(addr >= actual->vm_start && addr < actual->vm_end)break;
-      actual = actual->vm_next;
-    }
-
-    //hay mas vmas de las permitidas
-    if(i == p->numVmas){
-      p->killed = 1;
-      exit(-1);
-    }
-
-    //reservamos la memoria
-    char *pgAddr = kalloc();
-    if(!pgAddr) p->killed=1;
-
-    memset(pgAddr, 0 ,PGSIZE);
-
-    if(mappages(p->pagetable, addr, PGSIZE, (uint64)pgAddr, actual->vm_prot | PTE_U) != 0)
-    {
-      kfree(pgAddr);
-      p->killed = 1;
-      exit(-1);
-    }
-
-    ilock(actual->vm_file->ip);
-    readi(actual->vm_file->ip, 1, PGROUNDDOWN(addr), PGROUNDDOWN(addr) - actual->vm_start, PGSIZE);
-    iunlock(actual->vm_file->ip);
-
+    if(reclaimfault(p, r_stval(), r_scause() == 15) < 0)
+      setkilled(p);
   }
    else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
@@ -136,6 +86,14 @@ usertrap(void)
   if(which_dev == 2)
     yield();
 
+  // give back pages if the reclaim thread asked for some.
+  if(p->reclaim)
+    reclaimself(p);
+
+  // look for pages to merge if the ksm thread asked.
+  if(p->ksm)
+    ksmself(p);
+
   usertrapret();
   
 }
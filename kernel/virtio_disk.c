@@ -47,6 +47,8 @@ static struct disk {
   // indexed by first descriptor index of chain.
   struct {
     struct buf *b;
+    char *pa;                    // page of a page transfer
+    void (*done)(char*, uint);   // for one nobody waits for
     char status;
   } info[NUM];
 
@@ -212,13 +214,13 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Start a transfer of len bytes between data and the disk at
+// sector: allocate and format three descriptors and tell the
+// device. Returns the index of the first descriptor, which
+// names the request in disk.info[]. Caller holds vdisk_lock.
+static int
+submit(uint64 sector, void *data, uint len, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
   // data, one for a 1-byte status result.
@@ -249,12 +251,12 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
+  disk.desc[idx[1]].addr = (uint64) data;
+  disk.desc[idx[1]].len = len;
   if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+    disk.desc[idx[1]].flags = 0; // device reads data
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes data
   disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
   disk.desc[idx[1]].next = idx[2];
 
@@ -264,10 +266,6 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
   disk.desc[idx[2]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
-
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
 
@@ -280,14 +278,54 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
+  return idx[0];
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  uint64 sector = b->blockno * (BSIZE / 512);
+  int id;
+
+  acquire(&disk.vdisk_lock);
+
+  // record struct buf for virtio_disk_intr(), which cannot
+  // run before we release the lock.
+  b->disk = 1;
+  id = submit(sector, b->data, BSIZE, write);
+  disk.info[id].b = b;
+
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  disk.info[id].b = 0;
+  free_chain(id);
+
+  release(&disk.vdisk_lock);
+}
+
+// Transfer the page at pa to or from the PGSIZE/BSIZE disk
+// blocks from blockno on, bypassing the buffer cache, for
+// swap. If done is 0, wait for the transfer; otherwise return
+// once it has started, and have the interrupt handler call
+// done(pa, blockno) when it finishes. done runs holding
+// vdisk_lock, so it may only take spinlocks.
+void
+virtio_disk_page(char *pa, uint blockno, int write, void (*done)(char*, uint))
+{
+  int id;
 
+  acquire(&disk.vdisk_lock);
+  id = submit(blockno * (BSIZE / 512), pa, PGSIZE, write);
+  disk.info[id].pa = pa;
+  disk.info[id].done = done;
+  if(done == 0){
+    while(disk.info[id].pa)
+      sleep(&disk.info[id], &disk.vdisk_lock);
+    free_chain(id);
+  }
   release(&disk.vdisk_lock);
 }
 
@@ -317,8 +355,22 @@ virtio_disk_intr()
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    char *pa = disk.info[id].pa;
+    void (*done)(char*, uint) = disk.info[id].done;
+    if(b){
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+    } else if(done){
+      // nobody waits for this one.
+      uint blockno = disk.ops[id].sector / (BSIZE / 512);
+      disk.info[id].pa = 0;
+      disk.info[id].done = 0;
+      free_chain(id);
+      done(pa, blockno);
+    } else {
+      disk.info[id].pa = 0;
+      wakeup(&disk.info[id]);
+    }
 
     disk.used_idx += 1;
   }
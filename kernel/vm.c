@@ -3,8 +3,11 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
+#include "vma.h"
 
 /*
  * the kernel's page table.
@@ -21,8 +24,7 @@ kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -93,9 +95,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -165,8 +166,9 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages that were never faulted in are skipped.
+// Optionally free the physical memory, or the swap slots of
+// pages out on swap.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
@@ -177,15 +179,19 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & (PTE_V|PTE_SWAP)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      if(do_free)
+        swapfree(PTE2SLOT(*pte));
+      *pte = 0;
+      continue;
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
       uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      putref((void*)pa);
     }
     *pte = 0;
   }
@@ -197,10 +203,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -214,8 +219,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -233,12 +237,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -296,42 +299,317 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Copies the page table but not the physical memory:
+// writable pages become read-only and copy-on-write
+// in both page tables, and each shared page gains a
+// reference. uvmcow() makes the private copy.
 // returns 0 on success, -1 on failure.
-// frees any allocated pages on failure.
+// drops any references taken on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  return uvmcopyrange(old, new, 0, sz);
+}
+
+// Like uvmcopy(), for the pages in [start, end) only.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end)
+{
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = start; i < end; i += PGSIZE){
+    // pages never touched stay unmapped in the child too.
+    if((pte = walk(old, i, 0)) == 0 || (*pte & (PTE_V|PTE_SWAP)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      // both share the slot; each reads its own copy back.
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      swapdup(PTE2SLOT(*pte));
+      *npte = *pte;
+      continue;
+    }
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    incref((void*)pa);
+  }
+  return 0;
+
+ err:
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
+  return -1;
+}
+
+// Map the pages of old in [start, end) into new as they are,
+// for a MAP_SHARED mapping that both keep using: each page
+// gains a reference, and new starts out with it clean, so
+// that only the process that stores to it writes it back.
+// returns 0 on success, -1 on failure.
+// drops any references taken on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end)
+{
+  pte_t *pte;
+  uint64 pa, i;
+  uint flags;
+
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    flags = PTE_FLAGS(*pte) & ~(PTE_A|PTE_D);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    incref((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Resolve a write to the copy-on-write page at va:
+// give the page table a private, writable copy, or
+// just make the page writable if no one else shares it.
+// The shared zero page is never made writable in place.
+// Returns 0 on success, -1 if va is not a COW page
+// or memory is exhausted.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 || (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  if((void*)pa == zeropage()){
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+    *pte = PA2PTE(mem) | flags;
+    putref((void*)pa);
+    return 0;
+  }
+
+  if(getref((void*)pa) == 1){
+    // the other sharers are gone.
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  putref((void*)pa);
+  return 0;
+}
+
+// Handle a fault at va in p's address space, from the
+// hardware or from copyin()/copyout(). write is non-zero
+// for stores. Pages of the program image are read from its
+// file (see segfault() in exec.c). Other pages below p->sz,
+// heap and BSS, are allocated on first touch, zero-filled;
+// sbrk() only moves p->sz. A read of such a page maps the
+// shared zero page copy-on-write, so a private page is
+// allocated only by the first write. Pages out on swap are
+// read back (see swap.c).
+// Returns 0 if the access can be retried, -1 if it is
+// illegal or memory is exhausted.
+int
+vmfault(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  struct seg *s;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    // present: only a store to a copy-on-write page is legal.
+    if(write && (*pte & PTE_COW))
+      return uvmcow(p->pagetable, va);
+    return -1;
+  }
+  if(pte && (*pte & PTE_SWAP)){
+    if(swapin(pte) < 0)
+      return -1;
+    if(write && (*pte & PTE_COW))
+      return uvmcow(p->pagetable, va);
+    return 0;
+  }
+
+  if(va < p->sz && (s = findseg(p, va)) != 0)
+    return segfault(p, s, va, write);
+
+  if(va < p->sz && !write){
+    mem = zeropage();
+    if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_U|PTE_COW) != 0)
+      return -1;
+    incref(mem);
+    return 0;
+  }
+
+  if(va < p->sz){
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+    if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+      kfree(mem);
+      return -1;
+    }
+    return 0;
+  }
+
+  return mmapfault(p, va, write);
+}
+
+// Whether a fault at va would have to read the disk, which
+// sleeps: a page of the program file, of a file mapping, or
+// out on swap. Heap and anonymous pages, and copy-on-write,
+// need only memory.
+static int
+faultsleeps(struct proc *p, pte_t *pte, uint64 va)
+{
+  struct vma *v;
+
+  if(pte && (*pte & PTE_V))
+    return 0;
+  if(pte && (*pte & PTE_SWAP))
+    return 1;
+  if(va < p->sz)
+    return findseg(p, va) != 0;
+  return (v = vmalookup(p, va)) != 0 && (v->vm_flags & MAP_ANONYMOUS) == 0;
+}
+
+// Whether the current process holds no lock, and so may sleep.
+static int
+canblock(struct proc *p)
+{
+  int r;
+
+  push_off();
+  // push_off() itself is the one.
+  r = mycpu()->noff == 1 && p->nsleep == 0;
+  pop_off();
+  return r;
+}
+
+// Make the page at va accessible for a kernel copy to or
+// from user memory, faulting it in if the page table is the
+// current process's. A fault that would sleep is not taken
+// while the caller holds a lock: the page is left in
+// p->faultva for copyfault(). Returns the physical address,
+// or 0.
+static uint64
+uvmaccess(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_COW))){
+    if(p == 0 || p->pagetable != pagetable)
+      return 0;
+    if(faultsleeps(p, pte, va) && !canblock(p)){
+      p->faultva = PGROUNDDOWN(va);
+      p->copyfault = 1;
+      return 0;
+    }
+    if(vmfault(p, va, write) < 0)
+      return 0;
+    pte = walk(pagetable, va, 0);
+  }
+  if((*pte & PTE_U) == 0 || (write && (*pte & PTE_W) == 0))
+    return 0;
+  // the kernel's store goes to the physical page, so it must
+  // mark the page dirty itself, for writeback to see it.
+  if(write)
+    __sync_fetch_and_or(pte, PTE_D|PTE_A);
+  return PTE2PA(*pte);
+}
+
+// A copy made with a lock held failed: if it was for want of
+// a fault that would have slept, take the fault now that the
+// caller has let go of its locks. Returns 0 if the copy is
+// worth retrying, -1 if it failed for good.
+int
+copyfault(int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(p->copyfault == 0)
+    return -1;
+  p->copyfault = 0;
+  pte = walk(p->pagetable, p->faultva, 0);
+  if(pte && (*pte & PTE_V) && !(write && (*pte & PTE_COW)))
+    return 0;
+  return vmfault(p, p->faultva, write);
+}
+
+// Fault in the file-backed and swapped-out pages of the
+// current process in [va, va+n) ahead of a copy made while
+// holding a lock, so that the copy seldom has to stop for
+// copyfault(). Errors are left for the copy to report.
+void
+uvmprefault(uint64 va, uint64 n, int write)
+{
+  struct proc *p = myproc();
+  uint64 a;
+  pte_t *pte;
+
+  for(a = PGROUNDDOWN(va); a < va + n && a < MAXVA; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(faultsleeps(p, pte, a) && vmfault(p, a, write) < 0)
+      break;
+  }
+}
+
+// Make child, a page table with nothing but its trampoline
+// and trapframe mapped, share the parent's user memory for
+// vfork(): copy every top-level entry except the one that
+// covers the trapframe, so both use the same lower-level
+// page-table pages.
+void
+uvmborrow(pagetable_t parent, pagetable_t child)
+{
+  for(int i = 0; i < PX(2, TRAPFRAME); i++)
+    child[i] = parent[i];
+}
+
+// Undo uvmborrow(). Page-table pages the child added below
+// its (the parent's) size are handed to the parent.
+void
+uvmunborrow(pagetable_t parent, pagetable_t child)
+{
+  for(int i = 0; i < PX(2, TRAPFRAME); i++){
+    if(parent[i] == 0)
+      parent[i] = child[i];
+    child[i] = 0;
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -355,7 +633,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaccess(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -380,7 +658,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaccess(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -407,7 +685,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaccess(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -0,0 +1,361 @@
+// Per-process index of mappings (vmas).
+//
+// A process's vmas form an AVL tree ordered by start address,
+// rooted at p->vmaroot; the vmas are the tree nodes, so the
+// index needs no memory of its own. Each vma also records the
+// free space between it and the vma before it (vm_gap; the
+// first one counts from START_ADDRESS), and the largest such
+// gap in its subtree (vm_maxgap), so that vmaplace() finds the
+// lowest hole of a given size in O(log n).
+//
+// p->vmahint caches the vma of the last lookup: faults tend to
+// land in the same mapping again.
+//
+// Only the process itself changes its tree, holding p->lock;
+// other processes (the writeback thread) read it holding
+// p->lock too.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "vma.h"
+
+static int
+height(struct vma *v)
+{
+  return v ? v->vm_height : 0;
+}
+
+static uint64
+maxgap(struct vma *v)
+{
+  return v ? v->vm_maxgap : 0;
+}
+
+// recompute v's height and vm_maxgap from its children.
+static void
+update(struct vma *v)
+{
+  int hl = height(v->vm_left), hr = height(v->vm_right);
+  uint64 g = v->vm_gap;
+
+  v->vm_height = 1 + (hl > hr ? hl : hr);
+  if(maxgap(v->vm_left) > g)
+    g = maxgap(v->vm_left);
+  if(maxgap(v->vm_right) > g)
+    g = maxgap(v->vm_right);
+  v->vm_maxgap = g;
+}
+
+static struct vma*
+rotright(struct vma *y)
+{
+  struct vma *x = y->vm_left;
+
+  y->vm_left = x->vm_right;
+  x->vm_right = y;
+  update(y);
+  update(x);
+  return x;
+}
+
+static struct vma*
+rotleft(struct vma *x)
+{
+  struct vma *y = x->vm_right;
+
+  x->vm_right = y->vm_left;
+  y->vm_left = x;
+  update(x);
+  update(y);
+  return y;
+}
+
+// restore the AVL property at t, whose subtrees differ
+// in height by at most two. Returns the new subtree root.
+static struct vma*
+balance(struct vma *t)
+{
+  int bf;
+
+  update(t);
+  bf = height(t->vm_left) - height(t->vm_right);
+  if(bf > 1){
+    if(height(t->vm_left->vm_left) < height(t->vm_left->vm_right))
+      t->vm_left = rotleft(t->vm_left);
+    return rotright(t);
+  }
+  if(bf < -1){
+    if(height(t->vm_right->vm_right) < height(t->vm_right->vm_left))
+      t->vm_right = rotright(t->vm_right);
+    return rotleft(t);
+  }
+  return t;
+}
+
+static struct vma*
+insert(struct vma *t, struct vma *v)
+{
+  if(t == 0)
+    return v;
+  if(v->vm_start < t->vm_start)
+    t->vm_left = insert(t->vm_left, v);
+  else
+    t->vm_right = insert(t->vm_right, v);
+  return balance(t);
+}
+
+// unlink the lowest vma of t into *min.
+static struct vma*
+removemin(struct vma *t, struct vma **min)
+{
+  if(t->vm_left == 0){
+    *min = t;
+    return t->vm_right;
+  }
+  t->vm_left = removemin(t->vm_left, min);
+  return balance(t);
+}
+
+static struct vma*
+remove(struct vma *t, struct vma *v)
+{
+  struct vma *m;
+
+  if(t == 0)
+    panic("vmaremove");
+  if(v->vm_start < t->vm_start){
+    t->vm_left = remove(t->vm_left, v);
+  } else if(v->vm_start > t->vm_start){
+    t->vm_right = remove(t->vm_right, v);
+  } else {
+    if(t->vm_right == 0)
+      return t->vm_left;
+    t->vm_right = removemin(t->vm_right, &m);
+    m->vm_left = t->vm_left;
+    m->vm_right = t->vm_right;
+    return balance(m);
+  }
+  return balance(t);
+}
+
+// recompute vm_maxgap on the path from t down to v, after
+// v's gap changed.
+static void
+refresh(struct vma *t, struct vma *v)
+{
+  if(t == 0)
+    return;
+  if(v->vm_start < t->vm_start)
+    refresh(t->vm_left, v);
+  else if(v->vm_start > t->vm_start)
+    refresh(t->vm_right, v);
+  update(t);
+}
+
+// the last vma of t that starts below va, or 0.
+static struct vma*
+below(struct vma *t, uint64 va)
+{
+  struct vma *best = 0;
+
+  while(t){
+    if(t->vm_start < va){
+      best = t;
+      t = t->vm_right;
+    } else {
+      t = t->vm_left;
+    }
+  }
+  return best;
+}
+
+// the first vma of t that starts at or above va, or 0.
+static struct vma*
+above(struct vma *t, uint64 va)
+{
+  struct vma *best = 0;
+
+  while(t){
+    if(t->vm_start >= va){
+      best = t;
+      t = t->vm_left;
+    } else {
+      t = t->vm_right;
+    }
+  }
+  return best;
+}
+
+// recompute the gap before v, which is in p's tree.
+static void
+setgap(struct proc *p, struct vma *v)
+{
+  struct vma *prev = below(p->vmaroot, v->vm_start);
+
+  v->vm_gap = v->vm_start - (prev ? prev->vm_end : START_ADDRESS);
+  refresh(p->vmaroot, v);
+}
+
+// Return the vma of p that contains va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v = p->vmahint;
+
+  if(v && va >= v->vm_start && va < v->vm_end)
+    return v;
+  v = below(p->vmaroot, va + 1);
+  if(v == 0 || va >= v->vm_end)
+    return 0;
+  p->vmahint = v;
+  return v;
+}
+
+// Return p's lowest vma, or 0 if it has none.
+struct vma*
+vmafirst(struct proc *p)
+{
+  return above(p->vmaroot, 0);
+}
+
+// Return the vma of p after v, in address order, or 0.
+struct vma*
+vmanext(struct proc *p, struct vma *v)
+{
+  return above(p->vmaroot, v->vm_start + 1);
+}
+
+// Return the lowest address at which len bytes are free
+// in p's mapping area, or 0 if there is no room.
+uint64
+vmaplace(struct proc *p, uint64 len)
+{
+  struct vma *t = p->vmaroot, *last;
+  uint64 end;
+
+  if(t && t->vm_maxgap >= len){
+    // the in-order gaps of t are those of its left subtree,
+    // its own, then those of its right subtree.
+    for(;;){
+      if(maxgap(t->vm_left) >= len)
+        t = t->vm_left;
+      else if(t->vm_gap >= len)
+        return t->vm_start - t->vm_gap;
+      else
+        t = t->vm_right;
+    }
+  }
+
+  last = below(p->vmaroot, TOP_ADDRESS);
+  end = last ? last->vm_end : START_ADDRESS;
+  if(end + len < end || end + len > TOP_ADDRESS)
+    return 0;
+  return end;
+}
+
+// Add v, whose vm_start and vm_end are set and which overlaps
+// no other vma, to p's index.
+void
+vmainsert(struct proc *p, struct vma *v)
+{
+  struct vma *next;
+
+  v->vm_left = v->vm_right = 0;
+  v->vm_height = 1;
+  v->vm_gap = v->vm_maxgap = 0;
+  next = above(p->vmaroot, v->vm_start);
+  p->vmaroot = insert(p->vmaroot, v);
+  setgap(p, v);
+  if(next)
+    setgap(p, next);
+}
+
+// Remove v from p's index.
+void
+vmaremove(struct proc *p, struct vma *v)
+{
+  struct vma *next = vmanext(p, v);
+
+  p->vmaroot = remove(p->vmaroot, v);
+  if(p->vmahint == v)
+    p->vmahint = 0;
+  if(next)
+    setgap(p, next);
+}
+
+// Shrink v, which is in p's index, to [start, end).
+void
+vmaresize(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  struct vma *next = vmanext(p, v);
+
+  v->vm_start = start;
+  v->vm_end = end;
+  setgap(p, v);
+  if(next)
+    setgap(p, next);
+}
+
+// Split v, which is in p's index, at the page boundary va
+// inside it: v keeps [vm_start, va), and a new vma, which is
+// returned, takes [va, vm_end) with the same file and flags.
+// Returns 0 if no vma can be allocated.
+struct vma*
+vmasplit(struct proc *p, struct vma *v, uint64 va)
+{
+  struct vma *n;
+
+  if((n = vmaalloc()) == 0)
+    return 0;
+  *n = *v;
+  vmaresize(p, v, v->vm_start, va);
+  n->vm_start = va;
+  vmainsert(p, n);
+  if(n->vm_file)
+    filedup(n->vm_file);
+  return n;
+}
+
+// Return the lowest vma of p that overlaps [start, end), or 0.
+struct vma*
+vmaoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  if((v = vmalookup(p, start)) == 0)
+    v = above(p->vmaroot, start);
+  if(v == 0 || v->vm_start >= end)
+    return 0;
+  return v;
+}
+
+// Return 1 if every page of [start, end) is in a vma of p.
+int
+vmacovers(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  while(start < end){
+    if((v = vmalookup(p, start)) == 0)
+      return 0;
+    start = v->vm_end;
+  }
+  return 1;
+}
+
+// Split v, which is in p's index, so that one vma covers just
+// the part [start, end) of it, and return that vma. Returns 0
+// if no vma can be allocated.
+struct vma*
+vmaclip(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  if(start > v->vm_start && (v = vmasplit(p, v, start)) == 0)
+    return 0;
+  if(end < v->vm_end && vmasplit(p, v, end) == 0)
+    return 0;
+  return v;
+}
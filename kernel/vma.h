@@ -2,12 +2,14 @@
 #define PROT_READ (1L << 1)
 #define PROT_WRITE (1L << 2)
 #define PROT_READ_WRITE ((1L << 1)|(1L << 2))
+#define PROT_EXEC (1L << 3)
+#define PROT_NONE 0  //solo para mprotect: la pagina sigue, sin acceso
 
 //flags para mmap
 #define MAP_PRIVATE 1
 #define MAP_SHARED 2
-
-#define VMA_MAX 32
+#define MAP_ANONYMOUS 4  //con MAP_PRIVATE: memoria a cero, sin fichero
+#define MAP_POPULATE 8   //mapear todas las paginas ya en mmap()
 
 //Comienzo de la zona mapeable
 #define START_ADDRESS 0x2000000000  
@@ -18,6 +20,26 @@
 //fallo en mmap
 #define MAP_FAILED ((char *) -1)
 
+//maximo de paginas que mapea un fallo (fault-around)
+#define FAULTAROUND 32
+
+//flags para msync
+#define MS_ASYNC 1
+#define MS_SYNC 4
+
+//consejos para madvise
+#define MADV_NORMAL 0
+#define MADV_RANDOM 1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
+#define MADV_MERGEABLE 5    //compartir las paginas iguales a otras (ksm.c)
+#define MADV_UNMERGEABLE 6
+
+//ticks entre pasadas del hilo de writeback, y paginas por lote
+#define WBTICKS 10
+#define WBBATCH 32
+
 
 // the struct of a vma.
 struct vma {
@@ -27,24 +49,30 @@ struct vma {
     uint64  vm_offset;
 // vma end address
     uint64  vm_end;
-// vma lenght
-    uint64 vm_len;
 // vma flags
     uint64 vm_flags;
 // vma proctection
     uint64 vm_prot;
-// vma ref
-    uint64 vm_ref;
 // vma firts dir
     uint64 vm_firstDir;
-// vma's next vma
-    struct vma *vm_next;
+// vma's children in the process's index (see vma.c)
+    struct vma *vm_left;
+    struct vma *vm_right;
+    int vm_height;
+// free space between the previous vma and this one
+    uint64 vm_gap;
+// largest vm_gap in this subtree
+    uint64 vm_maxgap;
 // vma's file
     struct file *vm_file;
-// vma's is on use 
-    int use;
+// where a sequential scan would fault next
+    uint64 vm_nextfault;
+// pages the next fault maps, if sequential
+    int vm_window;
+// MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+    int vm_advice;
+// set by mlock(): pages stay mapped until munlock()
+    int vm_locked;
+// set by madvise(MADV_MERGEABLE): ksm.c may merge its pages
+    int vm_merge;
 };
-
-extern struct vma vmas[VMA_MAX];
-
-extern struct spinlock vmaslock; 
@@ -0,0 +1,131 @@
+// Compressed memory, a faster swap in front of the disk.
+//
+// swapwrite() offers each page on its way to swap to
+// zramstore() first. A page that compresses well (lz.c) is kept
+// here, compressed, and its page freed at once, without
+// writing the disk; a fault on it only has to decompress it.
+// Pages that do not compress, or that find the pool full, go
+// to disk as before.
+//
+// A compressed page is an object of the smallest size class
+// that holds it, from a slab cache per class, headed by its
+// length. The classes are sized so that each fills a slab.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "memstat.h"
+
+#define NZCLASS 8
+#define ZRAMMAX (MAXPAGES/8)  // most pages the pool may hold
+
+static uint zclass[NZCLASS] = { 248, 336, 504, 672, 808, 1008, 1352, 2024 };
+
+struct zobj {
+  ushort len;       // of the compressed data
+  uchar data[];
+};
+
+#define ZMAXLEN (2024 - sizeof(struct zobj))
+
+// compressed output, before we know its size class.
+static uchar zout[NCPU][ZMAXLEN];
+
+struct {
+  struct spinlock lock;
+  struct slabcache *cache[NZCLASS];
+  uint64 npages;    // pages held
+  uint64 nbytes;    // their compressed size
+  uint64 nalloc;    // bytes of the objects that hold them
+  uint64 nhit;      // pages decompressed by a fault
+  uint64 nreject;   // pages that went to disk instead
+} zram;
+
+void
+zraminit(void)
+{
+  initlock(&zram.lock, "zram");
+  for(int i = 0; i < NZCLASS; i++)
+    zram.cache[i] = slabcreate("zram", zclass[i]);
+}
+
+// The size class of an object for n bytes of compressed data.
+static int
+zclassof(int n)
+{
+  int c;
+
+  for(c = 0; zclass[c] < sizeof(struct zobj) + n; c++)
+    ;
+  return c;
+}
+
+// Compress the page at pa into the pool. Returns a handle for
+// zramload() and zramfree(), or 0 if it is not worth keeping
+// or there is no room. Does not sleep.
+void*
+zramstore(char *pa)
+{
+  struct zobj *z = 0;
+  uchar *out;
+  int n, c;
+
+  push_off();
+  out = zout[cpuid()];
+  n = lzcompress((uchar*)pa, PGSIZE, out, ZMAXLEN);
+  // the limit is not exact, for want of the lock.
+  if(n >= 0 && zram.nalloc + zclass[c = zclassof(n)] <= ZRAMMAX*PGSIZE &&
+     (z = slaballoc(zram.cache[c])) != 0){
+    z->len = n;
+    memmove(z->data, out, n);
+    acquire(&zram.lock);
+    zram.npages++;
+    zram.nbytes += n;
+    zram.nalloc += zclass[c];
+    release(&zram.lock);
+  }
+  pop_off();
+
+  if(z == 0)
+    __sync_fetch_and_add(&zram.nreject, 1);
+  return z;
+}
+
+// Decompress the page zramstore() kept as handle into mem.
+void
+zramload(void *handle, char *mem)
+{
+  struct zobj *z = handle;
+
+  if(lzdecompress(z->data, z->len, (uchar*)mem, PGSIZE) != PGSIZE)
+    panic("zramload");
+  __sync_fetch_and_add(&zram.nhit, 1);
+}
+
+// Drop a page zramstore() kept.
+void
+zramfree(void *handle)
+{
+  struct zobj *z = handle;
+  int c = zclassof(z->len);
+
+  acquire(&zram.lock);
+  zram.nalloc -= zclass[c];
+  zram.npages--;
+  zram.nbytes -= z->len;
+  release(&zram.lock);
+  slabfree(zram.cache[c], z);
+}
+
+void
+zramstat(struct memstat *st)
+{
+  st->nzram = zram.npages;
+  st->nzrambytes = zram.nbytes;
+  st->nzramalloc = zram.nalloc;
+  st->nzramhit = zram.nhit;
+  st->nzramreject = zram.nreject;
+}
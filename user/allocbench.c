@@ -0,0 +1,65 @@
+// Measure physical page allocation throughput as the
+// number of concurrent allocating processes grows.
+// Run with CPUS=8 to see how kalloc() scales with harts.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NPAGES 64     // pages grown and shrunk per round
+#define ROUNDS 200    // rounds per worker
+
+// grow the heap, touch every page so it is really
+// allocated, then give it all back.
+void
+worker(void)
+{
+  for(int r = 0; r < ROUNDS; r++){
+    char *a = sbrk(NPAGES*PGSIZE);
+    if(a == (char*)-1){
+      printf("allocbench: sbrk failed\n");
+      exit(1);
+    }
+    for(int i = 0; i < NPAGES; i++)
+      a[i*PGSIZE] = r;
+    sbrk(-NPAGES*PGSIZE);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxproc = 8;
+
+  if(argc > 1)
+    maxproc = atoi(argv[1]);
+
+  printf("procs  pages  ticks  pages/tick\n");
+  for(int n = 1; n <= maxproc; n *= 2){
+    int t0 = uptime();
+    for(int i = 0; i < n; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("allocbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        worker();
+    }
+    int ok = 1;
+    for(int i = 0; i < n; i++){
+      int xstatus;
+      wait(&xstatus);
+      if(xstatus != 0)
+        ok = 0;
+    }
+    int t = uptime() - t0;
+    if(!ok)
+      exit(1);
+    int pages = n * ROUNDS * NPAGES;
+    printf("%d  %d  %d  %d\n", n, pages, t, t ? pages / t : pages);
+  }
+  exit(0);
+}
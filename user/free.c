@@ -0,0 +1,44 @@
+// Print physical memory statistics.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat st;
+  uint64 below;
+  int k;
+
+  if(memstat(&st) < 0){
+    fprintf(2, "free: memstat failed\n");
+    exit(1);
+  }
+  printf("pages %d free %d (per-cpu %d zeroed %d) slab %d\n",
+         (int)st.npages, (int)st.nfree, (int)st.nfreecpu, (int)st.nzero,
+         (int)st.nslab);
+  printf("zero-page mappings %d page cache %d reclaimed %d\n",
+         (int)st.nzeromap, (int)st.npcache, (int)st.nreclaim);
+  printf("swap %d free %d out %d in %d\n", (int)st.nswap,
+         (int)st.nswapfree, (int)st.nswapout, (int)st.nswapin);
+  printf("zram %d pages in %d bytes (%d compressed, ratio %d%%)\n",
+         (int)st.nzram, (int)st.nzramalloc, (int)st.nzrambytes,
+         st.nzramalloc ? (int)(st.nzram * 4096 * 100 / st.nzramalloc) : 0);
+  printf("zram hits %d misses %d rejected %d\n", (int)st.nzramhit,
+         (int)(st.nswapin - st.nzramhit), (int)st.nzramreject);
+  printf("ksm shared %d saved %d merged %d\n", (int)st.nksmshared,
+         (int)st.nksmsaved, (int)st.nksmmerged);
+
+  // for each order, the percentage of free memory that sits in
+  // blocks too small to satisfy an allocation of that order.
+  printf("order blocks unusable%%\n");
+  below = st.nfreecpu;
+  for(k = 0; k < NORDER; k++){
+    printf("%d %d %d\n", k, (int)st.nblocks[k],
+           st.nfree ? (int)(below * 100 / st.nfree) : 0);
+    below += st.nblocks[k] << k;
+  }
+  exit(0);
+}
@@ -5,10 +5,22 @@
 #include "kernel/riscv.h"
 #include "kernel/fs.h"
 #include "kernel/vma.h"
+#include "kernel/memstat.h"
 #include "user/user.h"
 
 void mmap_test();
 void fork_test();
+void coherence_test();
+void offset_test();
+void msync_test();
+void bigmap_test();
+void anon_test();
+void manyvma_test();
+void madvise_test();
+void mprotect_test();
+void populate_test();
+void reclaim_test();
+void merge_test();
 char buf[BSIZE];
 
 #define MAP_FAILED ((char *) -1)
@@ -18,6 +30,17 @@ main(int argc, char *argv[])
 {
   mmap_test();
   fork_test();
+  coherence_test();
+  offset_test();
+  msync_test();
+  bigmap_test();
+  anon_test();
+  manyvma_test();
+  madvise_test();
+  mprotect_test();
+  populate_test();
+  reclaim_test();
+  merge_test();
   printf("mmaptest: all tests succeeded\n");
   exit(0);
 }
@@ -77,6 +100,27 @@ makefile(const char *f)
     err("close");
 }
 
+//
+// create a file of npg pages, page i filled with the byte i,
+// and return it open for reading and writing.
+//
+int
+makepages(const char *f, int npg)
+{
+  int fd, i, j;
+
+  unlink(f);
+  if ((fd = open(f, O_RDWR | O_CREATE)) == -1)
+    err("open");
+  for (i = 0; i < npg; i++) {
+    memset(buf, i, BSIZE);
+    for (j = 0; j < PGSIZE/BSIZE; j++)
+      if (write(fd, buf, BSIZE) != BSIZE)
+        err("write");
+  }
+  return fd;
+}
+
 void
 mmap_test(void)
 {
@@ -268,7 +312,771 @@ fork_test(void)
   // check that the parent's mappings are still there.
   _v1(p1);
   _v1(p2);
+  munmap(p1, PGSIZE*2);
+  munmap(p2, PGSIZE*2);
+  close(fd);
+
+  // the child starts with the parent's private changes, and
+  // each side's later stores stay its own; shared pages stay
+  // shared.
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open (2)");
+  unlink(f);
+  char *priv = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  char *shr = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (priv == MAP_FAILED || shr == MAP_FAILED)
+    err("mmap (6)");
+  priv[0] = 'P';
+  shr[PGSIZE] = 'S';
+  if((pid = fork()) < 0)
+    err("fork (2)");
+  if (pid == 0) {
+    if (priv[0] != 'P' || priv[PGSIZE] != 'S' || shr[PGSIZE] != 'S')
+      exit(1);
+    priv[0] = 'C';
+    shr[0] = 'C';
+    exit(0);
+  }
+  status = -1;
+  wait(&status);
+  if(status != 0)
+    err("child did not start with the parent's pages");
+  if (priv[0] != 'P')
+    err("child's private store seen by the parent");
+  if (shr[0] != 'C')
+    err("child's shared store not seen by the parent");
+  munmap(priv, PGSIZE*2);
+  munmap(shr, PGSIZE*2);
+  close(fd);
 
   printf("fork_test OK\n");
 }
 
+//
+// MAP_SHARED mappings of one file, in two processes, and
+// read() and write() of it, must all see the same bytes
+// without waiting for munmap(); a MAP_PRIVATE mapping sees
+// them too until it writes.
+//
+void
+coherence_test(void)
+{
+  int fd, pid, fds[2];
+  char c, b[101];
+  const char * const f = "mmap.dur";
+
+  printf("coherence_test starting\n");
+  testname = "coherence_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (6)");
+  char *q = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (q == MAP_FAILED)
+    err("mmap (7)");
+  close(fd);
+
+  // a child stores through its own mapping while still running.
+  if (pipe(fds) < 0)
+    err("pipe");
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    if ((fd = open(f, O_RDWR)) == -1)
+      err("open");
+    char *cp = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cp == MAP_FAILED)
+      err("mmap (8)");
+    cp[10] = 'X';
+    write(fds[1], "x", 1);
+    read(fds[0], &c, 1);  // wait until the parent has looked
+    exit(0);
+  }
+  if (read(fds[0], &c, 1) != 1)
+    err("read pipe");
+  if (p[10] != 'X' || q[10] != 'X')
+    err("store in another process not seen");
+  write(fds[1], "x", 1);
+  wait(0);
+  close(fds[0]);
+  close(fds[1]);
+
+  // write() is seen by the mappings.
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  if (write(fd, "hello", 5) != 5)
+    err("write");
+  close(fd);
+  if (memcmp(p, "hello", 5) != 0 || memcmp(q, "hello", 5) != 0)
+    err("write() not seen by mapping");
+
+  // a store is seen by read().
+  p[100] = 'Q';
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd, b, 101) != 101 || b[100] != 'Q')
+    err("store not seen by read()");
+  close(fd);
+
+  // a private store is not seen by anyone else.
+  q[200] = 'P';
+  if (p[200] != 'A')
+    err("private store leaked");
+
+  munmap(p, PGSIZE*2);
+  munmap(q, PGSIZE*2);
+  printf("coherence_test OK\n");
+}
+
+//
+// map a file from page-aligned offsets, and scan a larger
+// mapping sequentially, which the kernel serves with
+// fault-around.
+//
+void
+offset_test(void)
+{
+  enum { NPG = 32 };
+  int fd, i;
+  const char * const f = "mmap.off";
+
+  printf("offset_test starting\n");
+  testname = "offset_test";
+
+  fd = makepages(f, NPG);
+
+  char *p = mmap(0, PGSIZE*3, PROT_READ, MAP_PRIVATE, fd, PGSIZE*2);
+  if (p == MAP_FAILED)
+    err("mmap at offset");
+  if (p[0] != 2 || p[PGSIZE] != 3 || p[PGSIZE*3-1] != 4)
+    err("wrong data at offset");
+  // the front of the mapping goes; the rest keeps its offsets.
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap front");
+  if (p[PGSIZE] != 3 || p[PGSIZE*2] != 4)
+    err("wrong data after munmap");
+  munmap(p + PGSIZE, PGSIZE*2);
+
+  if (mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 100) != MAP_FAILED)
+    err("unaligned offset allowed");
+
+  // a shared mapping at an offset writes back to the right place.
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, PGSIZE*5);
+  if (p == MAP_FAILED)
+    err("mmap shared at offset");
+  p[7] = 'W';
+  munmap(p, PGSIZE);
+
+  p = mmap(0, PGSIZE*NPG, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap whole file");
+  for (i = 0; i < NPG*PGSIZE; i += 512)
+    if (p[i] != i / PGSIZE)
+      err("sequential scan mismatch");
+  if (p[PGSIZE*5 + 7] != 'W')
+    err("write-back at offset lost");
+  munmap(p, PGSIZE*NPG);
+  close(fd);
+  unlink(f);
+  printf("offset_test OK\n");
+}
+
+void
+msync_test(void)
+{
+  int fd, i;
+  const char * const f = "mmap.sync";
+
+  printf("msync_test starting\n");
+  testname = "msync_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+
+  if (msync(p + 1, PGSIZE, MS_SYNC) != -1)
+    err("unaligned msync allowed");
+  if (msync(p, PGSIZE*3, MS_SYNC) != -1)
+    err("msync past the mapping allowed");
+  if (msync(p, PGSIZE, 0) != -1)
+    err("msync without a mode allowed");
+
+  // a page stored to after msync() is dirty again, and
+  // munmap() writes it.
+  p[0] = 'a';
+  if (msync(p, PGSIZE*2, MS_SYNC) != 0)
+    err("msync sync");
+  p[1] = 'b';
+  p[PGSIZE] = 'c';
+  if (msync(p, PGSIZE*2, MS_ASYNC) != 0)
+    err("msync async");
+  p[PGSIZE+1] = 'd';
+  munmap(p, PGSIZE*2);
+  close(fd);
+
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open again");
+  for (i = 0; i < PGSIZE/BSIZE; i++) {
+    if (read(fd, buf, BSIZE) != BSIZE)
+      err("read");
+    if (i == 0 && (buf[0] != 'a' || buf[1] != 'b'))
+      err("first page not written back");
+  }
+  if (read(fd, buf, 2) != 2 || buf[0] != 'c' || buf[1] != 'd')
+    err("second page not written back");
+  close(fd);
+  unlink(f);
+  printf("msync_test OK\n");
+}
+
+//
+// unmap a shared mapping of many megabytes whose file pages
+// are all dirty: the write-back must fit the log.
+//
+void
+bigmap_test(void)
+{
+  enum { NPG = 64, MAPSZ = 8*1024*1024 };
+  int fd, i, j;
+  const char * const f = "mmap.big";
+
+  printf("bigmap_test starting\n");
+  testname = "bigmap_test";
+
+  unlink(f);
+  if ((fd = open(f, O_RDWR | O_CREATE)) == -1)
+    err("open");
+  memset(buf, 0, BSIZE);
+  for (i = 0; i < NPG * (PGSIZE/BSIZE); i++)
+    if (write(fd, buf, BSIZE) != BSIZE)
+      err("write");
+
+  // a file cannot grow past MAXFILE blocks, so the mapping
+  // reaches far beyond its end; only the file pages are touched.
+  char *p = mmap(0, MAPSZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  for (i = 0; i < NPG; i++) {
+    p[i*PGSIZE] = i;
+    p[i*PGSIZE + PGSIZE-1] = i;
+  }
+  if (munmap(p, MAPSZ) == -1)
+    err("munmap");
+  close(fd);
+
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open again");
+  for (i = 0; i < NPG; i++) {
+    for (j = 0; j < PGSIZE/BSIZE; j++) {
+      if (read(fd, buf, BSIZE) != BSIZE)
+        err("read");
+      if (j == 0 && buf[0] != i)
+        err("start of page not written back");
+      if (j == PGSIZE/BSIZE-1 && buf[BSIZE-1] != i)
+        err("end of page not written back");
+    }
+  }
+  close(fd);
+  unlink(f);
+  printf("bigmap_test OK\n");
+}
+
+//
+// anonymous memory: zero on first touch, private to each
+// process after fork, and given back to the kernel by munmap.
+//
+void
+anon_test(void)
+{
+  enum { NPG = 64 };
+  struct memstat before, touched, after;
+  int i, pid, xstatus;
+
+  printf("anon_test starting\n");
+  testname = "anon_test";
+
+  if (mmap(0, PGSIZE, PROT_READ, MAP_SHARED | MAP_ANONYMOUS, -1, 0) != MAP_FAILED)
+    err("shared anonymous mapping allowed");
+
+  memstat(&before);
+  char *p = mmap(0, PGSIZE*NPG, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  for (i = 0; i < NPG*PGSIZE; i += PGSIZE)
+    if (p[i] != 0 || p[i + PGSIZE-1] != 0)
+      err("not zero");
+  for (i = 0; i < NPG*PGSIZE; i += PGSIZE)
+    p[i] = i / PGSIZE;
+  memstat(&touched);
+  if (before.nfree - touched.nfree < NPG)
+    err("pages not allocated");
+
+  pid = fork();
+  if (pid < 0)
+    err("fork");
+  if (pid == 0) {
+    for (i = 0; i < NPG; i++)
+      if (p[i*PGSIZE] != i)
+        exit(1);
+    p[0] = 'c';
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0)
+    err("child did not see the parent's data");
+  if (p[0] != 0)
+    err("child's store seen by the parent");
+
+  if (munmap(p, PGSIZE*NPG) == -1)
+    err("munmap");
+  memstat(&after);
+  if (before.nfree - after.nfree > 16)
+    err("pages not released");
+  printf("anon_test OK\n");
+}
+
+//
+// thousands of mappings at once: each is found on a fault,
+// holes are reused lowest first, and an unmap in the middle
+// of a mapping leaves the pages on both sides.
+//
+void
+manyvma_test(void)
+{
+  enum { NVMA = 2000 };
+  static char *v[NVMA];
+  int i;
+
+  printf("manyvma_test starting\n");
+  testname = "manyvma_test";
+
+  for (i = 0; i < NVMA; i++) {
+    v[i] = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (v[i] == MAP_FAILED)
+      err("mmap");
+    *(int*)v[i] = i;
+  }
+  for (i = 0; i < NVMA; i++)
+    if (*(int*)v[i] != i)
+      err("wrong data");
+
+  // free every other one, then map two-page regions: the
+  // one-page holes are too small, so they go past the end.
+  for (i = 0; i < NVMA; i += 2)
+    if (munmap(v[i], PGSIZE) == -1)
+      err("munmap");
+  char *big = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (big == MAP_FAILED || big < v[NVMA-1])
+    err("two pages placed in a one-page hole");
+  char *small = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (small != v[0])
+    err("lowest hole not reused");
+  munmap(small, PGSIZE);
+  for (i = 1; i < NVMA; i += 2) {
+    if (*(int*)v[i] != i)
+      err("wrong data after munmap");
+    munmap(v[i], PGSIZE);
+  }
+
+  // punch a hole in the middle of a three-page mapping.
+  big[0] = 'a';
+  big[PGSIZE] = 'b';
+  munmap(big, PGSIZE*2);
+  char *p = mmap(0, PGSIZE*3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap three pages");
+  p[0] = 'x';
+  p[PGSIZE*2] = 'z';
+  if (munmap(p + PGSIZE, PGSIZE) == -1)
+    err("munmap middle");
+  if (p[0] != 'x' || p[PGSIZE*2] != 'z')
+    err("pages around the hole lost");
+  munmap(p, PGSIZE);
+  munmap(p + PGSIZE*2, PGSIZE);
+  printf("manyvma_test OK\n");
+}
+
+void
+madvise_test(void)
+{
+  enum { NPG = 64 };
+  int fd, i, pass;
+  const char * const f = "mmap.adv";
+
+  printf("madvise_test starting\n");
+  testname = "madvise_test";
+
+  fd = makepages(f, NPG);
+
+  char *p = mmap(0, PGSIZE*NPG, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  if (madvise(p, PGSIZE*NPG, 99) != -1)
+    err("unknown advice allowed");
+  if (madvise(p + 1, PGSIZE, MADV_RANDOM) != -1)
+    err("unaligned madvise allowed");
+  if (madvise(p, PGSIZE*(NPG+1), MADV_RANDOM) != -1)
+    err("madvise past the mapping allowed");
+
+  if (madvise(p, PGSIZE*NPG, MADV_WILLNEED) != 0)
+    err("willneed");
+
+  // a sequential scan drops the pages behind it; a second
+  // scan faults them in again.
+  if (madvise(p + PGSIZE*8, PGSIZE*(NPG-8), MADV_SEQUENTIAL) != 0)
+    err("sequential");
+  for (pass = 0; pass < 2; pass++)
+    for (i = 0; i < NPG*PGSIZE; i += 512)
+      if (p[i] != i / PGSIZE)
+        err("sequential scan mismatch");
+  if (madvise(p, PGSIZE*8, MADV_RANDOM) != 0)
+    err("random");
+  if (p[PGSIZE*3] != 3)
+    err("random access mismatch");
+
+  // dropping a dirty shared page writes it back first.
+  p[PGSIZE*2] = 'Z';
+  if (madvise(p + PGSIZE*2, PGSIZE, MADV_DONTNEED) != 0)
+    err("dontneed shared");
+  if (p[PGSIZE*2] != 'Z')
+    err("dirty page lost by dontneed");
+  munmap(p, PGSIZE*NPG);
+  close(fd);
+  unlink(f);
+
+  // dropping an anonymous page zeroes it.
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap anonymous");
+  p[0] = 1;
+  p[PGSIZE] = 2;
+  if (madvise(p, PGSIZE, MADV_DONTNEED) != 0)
+    err("dontneed anonymous");
+  if (p[0] != 0 || p[PGSIZE] != 2)
+    err("dontneed anonymous contents");
+  munmap(p, PGSIZE*2);
+  printf("madvise_test OK\n");
+}
+
+// in a child, touch p (store if write is set), and return 1
+// if the child survived.
+int
+survives(char *p, int write)
+{
+  int pid, xstatus;
+
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    if (write)
+      *p = 'x';
+    else
+      *(volatile char*)buf = *(volatile char*)p;
+    exit(0);
+  }
+  wait(&xstatus);
+  return xstatus == 0;
+}
+
+void
+mprotect_test(void)
+{
+  int fd;
+  const char * const f = "mmap.prot";
+
+  printf("mprotect_test starting\n");
+  testname = "mprotect_test";
+
+  char *p = mmap(0, PGSIZE*3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap anonymous");
+  p[0] = 'a';
+  p[PGSIZE] = 'b';
+  p[PGSIZE*2] = 'c';
+
+  // the middle page becomes read-only, then a guard page.
+  if (mprotect(p + PGSIZE, PGSIZE, PROT_READ) != 0)
+    err("mprotect read");
+  if (p[PGSIZE] != 'b')
+    err("read-only page lost its contents");
+  if (survives(p + PGSIZE, 1))
+    err("store to a read-only page allowed");
+  if (!survives(p + PGSIZE*2, 1))
+    err("store next to a read-only page refused");
+  if (mprotect(p + PGSIZE, PGSIZE, PROT_NONE) != 0)
+    err("mprotect none");
+  if (survives(p + PGSIZE, 0))
+    err("load from a PROT_NONE page allowed");
+
+  // write access comes back with the same page.
+  if (mprotect(p, PGSIZE*3, PROT_READ | PROT_WRITE) != 0)
+    err("mprotect read-write");
+  if (p[PGSIZE] != 'b')
+    err("contents lost across mprotect");
+  p[PGSIZE] = 'B';
+  if (p[0] != 'a' || p[PGSIZE] != 'B' || p[PGSIZE*2] != 'c')
+    err("wrong data after mprotect");
+  munmap(p, PGSIZE*3);
+
+  // a shared mapping of a read-only file cannot become writable.
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open read-only");
+  p = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap read-only file");
+  if (mprotect(p, PGSIZE, PROT_READ | PROT_WRITE) != -1)
+    err("shared mapping of a read-only file made writable");
+  munmap(p, PGSIZE);
+  close(fd);
+
+  // a dirty shared page made read-only is still written back.
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap shared");
+  p[0] = 'Q';
+  if (mprotect(p, PGSIZE, PROT_READ) != 0)
+    err("mprotect shared");
+  munmap(p, PGSIZE);
+  close(fd);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open again");
+  if (read(fd, buf, 1) != 1 || buf[0] != 'Q')
+    err("dirty page not written back after mprotect");
+  close(fd);
+  unlink(f);
+  printf("mprotect_test OK\n");
+}
+
+void
+populate_test(void)
+{
+  enum { NPG = 16 };
+  struct memstat before, after;
+  int fd, i;
+  const char * const f = "mmap.pop";
+
+  printf("populate_test starting\n");
+  testname = "populate_test";
+
+  fd = makepages(f, NPG);
+
+  // the file's pages are read at mmap() time, not at first touch.
+  memstat(&before);
+  char *p = mmap(0, PGSIZE*NPG, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap populate");
+  memstat(&after);
+  if (after.npcache - before.npcache < NPG)
+    err("file pages not read by MAP_POPULATE");
+  for (i = 0; i < NPG; i++)
+    if (p[i*PGSIZE] != i)
+      err("wrong data");
+  munmap(p, PGSIZE*NPG);
+  close(fd);
+  unlink(f);
+
+  // writable anonymous pages are allocated at once.
+  memstat(&before);
+  p = mmap(0, PGSIZE*NPG, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap anonymous populate");
+  memstat(&after);
+  if (before.nfree - after.nfree < NPG)
+    err("anonymous pages not allocated by MAP_POPULATE");
+  munmap(p, PGSIZE*NPG);
+
+  // mlock() faults pages in and keeps them.
+  p = mmap(0, PGSIZE*NPG, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap anonymous");
+  memstat(&before);
+  if (mlock(p, PGSIZE*NPG) != 0)
+    err("mlock");
+  memstat(&after);
+  if (before.nfree - after.nfree < NPG)
+    err("pages not allocated by mlock");
+  p[0] = 'L';
+  if (madvise(p, PGSIZE, MADV_DONTNEED) != -1)
+    err("locked page dropped");
+  if (munlock(p, PGSIZE*NPG) != 0)
+    err("munlock");
+  if (madvise(p, PGSIZE, MADV_DONTNEED) != 0 || p[0] != 0)
+    err("unlocked page not dropped");
+  if (mlock(p + PGSIZE*NPG, PGSIZE) != -1)
+    err("mlock of unmapped memory allowed");
+  munmap(p, PGSIZE*NPG);
+  printf("populate_test OK\n");
+}
+
+//
+// use up memory while another process keeps a file mapped
+// but idle: its pages should be reclaimed, its stores written
+// back first, and its pages read back from the file.
+//
+void
+reclaim_test(void)
+{
+  enum { NPG = 64 };
+  struct memstat before, st;
+  int fd, i, j, pid, hog, xstatus;
+  int fds[2];
+  char c;
+  const char * const f = "mmap.reclaim";
+
+  printf("reclaim_test starting\n");
+  testname = "reclaim_test";
+
+  fd = makepages(f, NPG);
+  if (pipe(fds) < 0)
+    err("pipe");
+  memstat(&before);
+
+  pid = fork();
+  if (pid < 0)
+    err("fork");
+  if (pid == 0) {
+    close(fds[0]);
+    char *p = mmap(0, PGSIZE*NPG, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      exit(1);
+    for (i = 0; i < NPG; i++)
+      p[i*PGSIZE + 1] = 'd';
+    write(fds[1], "x", 1);
+    // keep trapping into the kernel without touching the pages,
+    // but not for ever if the hog gives up first.
+    int deadline = uptime() + 1000;
+    do {
+      memstat(&st);
+      if (uptime() > deadline)
+        exit(1);
+    } while (st.nreclaim - before.nreclaim < NPG/2);
+    for (i = 0; i < NPG; i++)
+      if (p[i*PGSIZE] != i || p[i*PGSIZE + 1] != 'd')
+        exit(1);
+    exit(0);
+  }
+  close(fds[1]);
+  if (read(fds[0], &c, 1) != 1)
+    err("mapping child failed");
+  close(fds[0]);
+
+  hog = fork();
+  if (hog < 0)
+    err("fork");
+  if (hog == 0) {
+    for (;;) {
+      char *a = sbrk(PGSIZE);
+      if (a == (char*)-1)
+        exit(1);
+      *a = 1;
+      memstat(&st);
+      if (st.nreclaim - before.nreclaim >= NPG/2)
+        exit(0);
+    }
+  }
+
+  for (i = 0; i < 2; i++) {
+    if ((j = wait(&xstatus)) < 0)
+      err("wait");
+    if (xstatus != 0) {
+      kill(j == hog ? pid : hog);
+      err(j == hog ? "memory hog died" : "mapped pages lost");
+    }
+  }
+
+  // the stores reached the file.
+  close(fd);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  for (i = 0; i < NPG; i++) {
+    if (read(fd, buf, BSIZE) != BSIZE)
+      err("read");
+    if (buf[0] != i || buf[1] != 'd')
+      err("stores not written back");
+    for (j = 1; j < PGSIZE/BSIZE; j++)
+      if (read(fd, buf, BSIZE) != BSIZE)
+        err("read");
+  }
+  close(fd);
+  unlink(f);
+  printf("reclaim_test OK\n");
+}
+
+// two processes each fill an anonymous mapping with pages of
+// NPAT different contents; once marked mergeable, their pages
+// come to share NPAT frames, and a store still only changes
+// the page stored to.
+void
+merge_test(void)
+{
+  enum { NPG = 32, NPAT = 8 };
+  struct memstat before, st;
+  int i, j, pid, xstatus;
+
+  printf("merge_test starting\n");
+  testname = "merge_test";
+
+  memstat(&before);
+  pid = fork();
+  if (pid < 0)
+    err("fork");
+
+  char *p = mmap(0, PGSIZE*NPG, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  if (madvise(p, PGSIZE*NPG, MADV_MERGEABLE) != 0)
+    err("madvise");
+  for (i = 0; i < NPG; i++)
+    memset(p + i*PGSIZE, 'a' + i % NPAT, PGSIZE);
+
+  // wait, trapping into the kernel, for the pages to merge.
+  for (j = 0; j < 1000; j++) {
+    memstat(&st);
+    if (st.nksmsaved - before.nksmsaved >= NPG)
+      break;
+    sleep(1);
+  }
+  if (j == 1000) {
+    if (pid == 0)
+      exit(1);
+    err("pages not merged");
+  }
+
+  for (i = 0; i < NPG; i++)
+    for (j = 0; j < PGSIZE; j += 512)
+      if (p[i*PGSIZE + j] != 'a' + i % NPAT) {
+        if (pid == 0)
+          exit(1);
+        err("merged page changed");
+      }
+  p[0] = 'z';
+  if (p[NPAT*PGSIZE] != 'a' || p[1] != 'a') {
+    if (pid == 0)
+      exit(1);
+    err("store to a merged page");
+  }
+
+  if (pid == 0)
+    exit(0);
+  if (wait(&xstatus) != pid || xstatus != 0)
+    err("child's pages not merged");
+  if (munmap(p, PGSIZE*NPG) != 0)
+    err("munmap");
+
+  memstat(&st);
+  if (st.nksmmerged == before.nksmmerged)
+    err("nothing merged");
+  printf("merge_test OK\n");
+}
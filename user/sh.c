@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -52,13 +53,52 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 void runcmd(struct cmd*) __attribute__((noreturn));
 
+// Start cmd with spawn() if it is a simple command, perhaps
+// with redirections, rather than by forking the shell. The
+// nact actions in act are applied to the child's files first.
+// Returns the child's pid, or -1 if cmd must be run by a
+// forked shell instead (which also reports any error).
+int
+spawncmd(struct cmd *cmd, struct spawnact *act, int nact)
+{
+  struct execcmd *ecmd;
+  struct redircmd *rcmd;
+  int fd, pid;
+
+  switch(cmd->type){
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    if(ecmd->argv[0] == 0)
+      return -1;
+    return spawn(ecmd->argv[0], ecmd->argv, act, nact);
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    if(nact + 2 > SPAWN_MAXACT)
+      return -1;
+    if((fd = open(rcmd->file, rcmd->mode)) < 0)
+      return -1;
+    act[nact].op = SPAWN_DUP2;
+    act[nact].fd = fd;
+    act[nact].newfd = rcmd->fd;
+    act[nact+1].op = SPAWN_CLOSE;
+    act[nact+1].fd = fd;
+    pid = spawncmd(rcmd->cmd, act, nact + 2);
+    close(fd);
+    return pid;
+  }
+  return -1;
+}
+
 // Execute cmd.  Never returns.
 void
 runcmd(struct cmd *cmd)
 {
   int p[2];
+  struct spawnact act[SPAWN_MAXACT];
   struct backcmd *bcmd;
   struct execcmd *ecmd;
   struct listcmd *lcmd;
@@ -92,7 +132,7 @@ runcmd(struct cmd *cmd)
 
   case LIST:
     lcmd = (struct listcmd*)cmd;
-    if(fork1() == 0)
+    if(spawncmd(lcmd->left, act, 0) < 0 && fork1() == 0)
       runcmd(lcmd->left);
     wait(0);
     runcmd(lcmd->right);
@@ -102,14 +142,23 @@ runcmd(struct cmd *cmd)
     pcmd = (struct pipecmd*)cmd;
     if(pipe(p) < 0)
       panic("pipe");
-    if(fork1() == 0){
+    act[0].op = SPAWN_DUP2;
+    act[0].fd = p[1];
+    act[0].newfd = 1;
+    act[1].op = SPAWN_CLOSE;
+    act[1].fd = p[0];
+    act[2].op = SPAWN_CLOSE;
+    act[2].fd = p[1];
+    if(spawncmd(pcmd->left, act, 3) < 0 && fork1() == 0){
       close(1);
       dup(p[1]);
       close(p[0]);
       close(p[1]);
       runcmd(pcmd->left);
     }
-    if(fork1() == 0){
+    act[0].fd = p[0];
+    act[0].newfd = 0;
+    if(spawncmd(pcmd->right, act, 3) < 0 && fork1() == 0){
       close(0);
       dup(p[0]);
       close(p[0]);
@@ -146,6 +195,8 @@ int
 main(void)
 {
   static char buf[100];
+  struct spawnact act[SPAWN_MAXACT];
+  struct cmd *cmd;
   int fd;
 
   // Ensure that three file descriptors are open.
@@ -165,9 +216,15 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
+    // parse here rather than in a child, so that simple
+    // commands can be spawned without forking the shell.
+    cmd = parsecmd(buf);
+    if(cmd == 0)
+      continue;
+    if(spawncmd(cmd, act, 0) < 0 && fork1() == 0)
+      runcmd(cmd);
     wait(0);
+    freecmd(cmd);
   }
   exit(0);
 }
@@ -179,6 +236,18 @@ panic(char *s)
   exit(1);
 }
 
+// Report a syntax error in the command being parsed.
+// The shell itself does the parsing, so this must not exit.
+int parseerr;
+
+void
+syntax(char *s)
+{
+  if(!parseerr)
+    fprintf(2, "%s\n", s);
+  parseerr = 1;
+}
+
 int
 fork1(void)
 {
@@ -325,20 +394,26 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// Returns 0 after reporting a syntax error.
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  parseerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
   }
   nulterminate(cmd);
+  if(parseerr){
+    freecmd(cmd);
+    return 0;
+  }
   return cmd;
 }
 
@@ -381,7 +456,7 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
     if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+      syntax("missing file for redirection");
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -407,7 +482,7 @@ parseblock(char **ps, char *es)
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
   if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+    syntax("syntax - missing )");
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -432,13 +507,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
+    if(argc >= MAXARGS){
+      syntax("too many args");
+      break;
+    }
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -492,3 +571,41 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+// Free a command tree built by parsecmd().
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
@@ -0,0 +1,69 @@
+// Measure the latency of starting a program three ways:
+// fork() then exec(), vfork() then exec(), and spawn(),
+// from a parent with a small and with a large heap.
+// The program started is this one, told to exit at once.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define N     100               // programs started per measurement
+#define BIG   (8*1024*1024)     // heap bytes touched for the large case
+
+char *args[] = { "spawnbench", "-x", 0 };
+char *names[] = { "fork+exec", "vfork+exec", "spawn" };
+
+// start args[0] one way and wait for it.
+// returns its exit status, or -1.
+int
+run(int how)
+{
+  int pid, xstatus;
+
+  if(how == 0)
+    pid = fork();
+  else if(how == 1)
+    pid = vfork();
+  else
+    pid = spawn(args[0], args, 0, 0);
+  if(pid == 0){
+    exec(args[0], args);
+    exit(1);
+  }
+  if(pid < 0)
+    return -1;
+  wait(&xstatus);
+  return xstatus;
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit(0);
+
+  printf("heap    method      ticks/%d\n", N);
+  for(int big = 0; big < 2; big++){
+    if(big){
+      char *a = sbrk(BIG);
+      if(a == (char*)-1){
+        printf("spawnbench: sbrk failed\n");
+        exit(1);
+      }
+      for(int i = 0; i < BIG; i += PGSIZE)
+        a[i] = 1;
+    }
+    for(int how = 0; how < 3; how++){
+      int t0 = uptime();
+      for(int i = 0; i < N; i++){
+        if(run(how) != 0){
+          printf("spawnbench: %s failed\n", names[how]);
+          exit(1);
+        }
+      }
+      printf("%s  %s  %d\n", big ? "8MB  " : "small", names[how], uptime() - t0);
+    }
+  }
+  exit(0);
+}
@@ -0,0 +1,54 @@
+// Measure program startup latency as a function of how much of
+// the program is used. This program carries a large initialized
+// array; started with -x it exits at once, with -t it first reads
+// all of the array. With demand-paged exec the first case should
+// not pay for reading the array from disk.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define N     50                // programs started per measurement
+#define PAD   (64*1024)         // bytes of initialized data
+
+char pad[PAD] = { 1 };
+
+char *modes[] = { "-x", "-t" };
+char *names[] = { "exit at once", "touch all data" };
+
+int
+main(int argc, char *argv[])
+{
+  char *args[] = { "startbench", 0, 0 };
+  int sum = 0;
+
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit(0);
+  if(argc > 1 && strcmp(argv[1], "-t") == 0){
+    for(int i = 0; i < PAD; i += PGSIZE)
+      sum += pad[i];
+    exit(sum == 1 ? 0 : 1);
+  }
+
+  printf("startbench: %d KB of data, ticks per %d starts\n", PAD / 1024, N);
+  for(int m = 0; m < 2; m++){
+    args[1] = modes[m];
+    int t0 = uptime();
+    for(int i = 0; i < N; i++){
+      int pid = spawn(args[0], args, 0, 0);
+      int xstatus;
+      if(pid < 0){
+        printf("startbench: spawn failed\n");
+        exit(1);
+      }
+      wait(&xstatus);
+      if(xstatus != 0){
+        printf("startbench: child failed\n");
+        exit(1);
+      }
+    }
+    printf("%s  %d\n", names[m], uptime() - t0);
+  }
+  exit(0);
+}
@@ -1,4 +1,6 @@
 struct stat;
+struct memstat;
+struct spawnact;
 
 // system calls
 int fork(void);
@@ -24,6 +26,15 @@ int sleep(int);
 int uptime(void);
 void* mmap(void *, uint64 , int , int , int, int);
 int munmap(void *, uint64);
+int memstat(struct memstat*);
+int spawn(const char*, char**, struct spawnact*, int);
+int vfork(void);
+int msync(void*, uint64, int);
+int madvise(void*, uint64, int);
+int mprotect(void*, uint64, int);
+int mlock(void*, uint64);
+int munlock(void*, uint64);
+int buddytest(int, int);  // make KTEST=1 only
 
 // ulib.c
 int stat(const char*, struct stat*);
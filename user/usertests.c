@@ -7,6 +7,8 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/memstat.h"
+#include "kernel/spawn.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -1921,9 +1923,10 @@ dirfile(char *s)
 void
 iref(char *s)
 {
+  enum { N = 51 };  // more than the kernel once had inodes
   int i, fd;
 
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     if(mkdir("irefd") != 0){
       printf("%s: mkdir irefd failed\n", s);
       exit(1);
@@ -1945,7 +1948,7 @@ iref(char *s)
   }
 
   // clean up
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     chdir("..");
     unlink("irefd");
   }
@@ -2556,6 +2559,518 @@ sbrk8000(char *s)
 
 
 
+// with copy-on-write fork, a process holding more than half
+// of free memory can still fork, repeatedly, and parent and
+// child each see only their own writes.
+void
+cowpressure(char *s)
+{
+  struct memstat st;
+  int i, pid, xstatus;
+
+  if(memstat(&st) < 0){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  uint64 sz = (st.nfree * 3 / 5) * PGSIZE;
+  char *p = sbrk(sz);
+  if(p == (char*)-1){
+    printf("%s: sbrk(%d) failed\n", s, (int)sz);
+    exit(1);
+  }
+  for(uint64 a = 0; a < sz; a += PGSIZE)
+    p[a] = 'p';
+
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      // write a few pages; each gets its own copy.
+      for(uint64 a = 0; a < sz; a += 64*PGSIZE){
+        if(p[a] != 'p')
+          exit(1);
+        p[a] = 'c';
+      }
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child saw wrong data\n", s);
+      exit(1);
+    }
+  }
+  for(uint64 a = 0; a < sz; a += PGSIZE){
+    if(p[a] != 'p'){
+      printf("%s: child write leaked into parent\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-sz);
+}
+
+// a chain of processes, each forked from the last, each
+// overwriting its copy of a shared array; every level
+// checks that its own copy is unchanged afterwards, and
+// that read() into a shared page copies it first.
+void
+cowchain(char *s)
+{
+  enum { DEPTH = 10, N = 8*PGSIZE };
+  static char a[N];
+  int fds[2];
+  int depth, pid, xstatus;
+
+  for(int i = 0; i < N; i++)
+    a[i] = 0;
+
+  for(depth = 0; depth < DEPTH; depth++){
+    if(pipe(fds) < 0){
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid > 0){
+      // hand the child a byte to read() into its shared copy.
+      close(fds[0]);
+      char c = depth + 1;
+      write(fds[1], &c, 1);
+      close(fds[1]);
+      wait(&xstatus);
+      for(int i = 0; i < N; i += 512){
+        if(a[i] != depth){
+          printf("%s: level %d sees %d\n", s, depth, a[i]);
+          exit(1);
+        }
+      }
+      exit(xstatus);
+    }
+    // child: copyout() into the COW page must not touch the parent.
+    close(fds[1]);
+    if(read(fds[0], &a[N/2], 1) != 1 || a[N/2] != depth + 1){
+      printf("%s: read into cow page failed\n", s);
+      exit(1);
+    }
+    close(fds[0]);
+    for(int i = 0; i < N; i++)
+      a[i] = depth + 1;
+  }
+  exit(0);
+}
+
+// sbrk() of a large region should cost nothing until it is
+// touched; fork() and read()/write() must cope with the
+// holes left between the pages that were.
+void
+sbrklazy(char *s)
+{
+  enum { SZ = 64*1024*1024 };
+  struct memstat before, after;
+  int fds[2], pid, xstatus;
+  char *p;
+
+  if(memstat(&before) < 0){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  p = sbrk(SZ);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  if(memstat(&after) < 0 || before.nfree - after.nfree > 16){
+    printf("%s: sbrk allocated memory eagerly\n", s);
+    exit(1);
+  }
+
+  // touch every 16th page.
+  for(int i = 0; i < SZ; i += 16*PGSIZE)
+    p[i] = i / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(int i = 0; i < SZ; i += 16*PGSIZE){
+      if(p[i] != (char)(i / PGSIZE)){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+      if(p[i + 8*PGSIZE] != 0){
+        printf("%s: untouched page not zero\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+
+  // the kernel copies into and out of pages never touched.
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], p + SZ - 3*PGSIZE, 10) != 10 ||
+     read(fds[0], p + SZ - PGSIZE, 10) != 10){
+    printf("%s: copy to or from a lazy page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-SZ);
+}
+
+// reading a large untouched region should map the shared
+// zero page rather than allocate; the first write to a page
+// must give it a private copy without disturbing the rest.
+void
+zeropage(char *s)
+{
+  enum { SZ = 16*1024*1024 };
+  struct memstat before, after;
+  char *p;
+  int sum = 0;
+
+  memstat(&before);
+  p = sbrk(SZ);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < SZ; i += PGSIZE)
+    sum += p[i];
+  memstat(&after);
+  if(sum != 0){
+    printf("%s: untouched memory not zero\n", s);
+    exit(1);
+  }
+  // allow for page-table pages.
+  if(before.nfree - after.nfree > 64 || after.nzeromap < SZ / PGSIZE){
+    printf("%s: reads allocated %d pages\n", s, (int)(before.nfree - after.nfree));
+    exit(1);
+  }
+
+  p[SZ/2] = 'x';
+  if(p[SZ/2] != 'x' || p[SZ/2 - PGSIZE] != 0 || p[SZ/2 + PGSIZE] != 0){
+    printf("%s: write to zero page leaked\n", s);
+    exit(1);
+  }
+  sbrk(-SZ);
+}
+
+// spawn() echo with its output redirected into a pipe by
+// file actions; a program that does not exist must fail
+// without leaving a child behind.
+void
+spawntest(char *s)
+{
+  char *echoargv[] = { "echo", "OK", 0 };
+  struct spawnact act[3];
+  int fds[2], pid, xstatus;
+  char buf[3];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  act[0].op = SPAWN_DUP2;
+  act[0].fd = fds[1];
+  act[0].newfd = 1;
+  act[1].op = SPAWN_CLOSE;
+  act[1].fd = fds[0];
+  act[2].op = SPAWN_CLOSE;
+  act[2].fd = fds[1];
+  pid = spawn("echo", echoargv, act, 3);
+  if(pid < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  if(read(fds[0], buf, 3) != 3 || buf[0] != 'O' || buf[1] != 'K'){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+
+  if(spawn("nosuchprogram", echoargv, 0, 0) >= 0){
+    printf("%s: spawned a missing program\n", s);
+    exit(1);
+  }
+  act[0].fd = 100;
+  if(spawn("echo", echoargv, act, 1) >= 0){
+    printf("%s: spawned with a bad file action\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: failed spawn left a child\n", s);
+    exit(1);
+  }
+}
+
+// the parent of vfork() must not run until the child has
+// called exec() or exit(), and then finds its memory as the
+// child left it; the child may not grow the address space.
+void
+vforktest(char *s)
+{
+  char *echoargv[] = { "echo", 0 };
+  static volatile int shared;
+  int pid, xstatus;
+
+  shared = 0;
+  pid = vfork();
+  if(pid < 0){
+    printf("%s: vfork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    shared = 1;
+    if(sbrk(PGSIZE) != (char*)-1)
+      shared = 2;
+    exit(0);
+  }
+  if(shared != 1){
+    printf("%s: parent sees %d\n", s, shared);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+
+  pid = vfork();
+  if(pid < 0){
+    printf("%s: vfork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);  // keep the output of echo quiet
+    exec("echo", echoargv);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: exec in vfork child failed\n", s);
+    exit(1);
+  }
+}
+
+// pages of the program's initialized data are read from the
+// file when first touched, including by the kernel copying
+// into them from a pipe, which it does holding a spinlock.
+char execdata[3*PGSIZE] = { 'a', [PGSIZE] = 'b', [2*PGSIZE] = 'c' };
+
+void
+execpaging(char *s)
+{
+  int fds[2];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "xy", 2) != 2 || read(fds[0], &execdata[PGSIZE+1], 2) != 2){
+    printf("%s: pipe read into data failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(execdata[0] != 'a' || execdata[PGSIZE] != 'b' || execdata[PGSIZE+1] != 'x' ||
+     execdata[PGSIZE+2] != 'y' || execdata[2*PGSIZE] != 'c'){
+    printf("%s: wrong initialized data\n", s);
+    exit(1);
+  }
+}
+
+// a program run twice should find its pages in the page cache
+// the second time rather than reading them again.
+void
+sharedtext(char *s)
+{
+  char *echoargv[] = { "echo", 0 };
+  struct spawnact act = { SPAWN_CLOSE, 1, 0 };
+  struct memstat st[3];
+
+  for(int i = 0; i < 3; i++){
+    if(i > 0){
+      if(spawn("echo", echoargv, &act, 1) < 0){
+        printf("%s: spawn failed\n", s);
+        exit(1);
+      }
+      wait(0);
+    }
+    memstat(&st[i]);
+  }
+  if(st[1].npcache == 0){
+    printf("%s: nothing cached\n", s);
+    exit(1);
+  }
+  if(st[2].npcache != st[1].npcache){
+    printf("%s: second run cached %d more pages\n", s,
+           (int)(st[2].npcache - st[1].npcache));
+    exit(1);
+  }
+}
+
+// fill a page with words that do not compress, from seed.
+static void
+noisepage(uint64 *p, uint64 seed)
+{
+  uint64 x = seed * 2654435761ULL + 1;
+
+  for(int i = 0; i < PGSIZE/8; i++){
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    p[i] = x;
+  }
+}
+
+// write more pages than there is free memory: those that do
+// not fit go to swap and come back intact, and their swap
+// slots are freed with them. the pages do not compress, so
+// they go to disk.
+void
+swapover(char *s)
+{
+  struct memstat before, after;
+  static uint64 want[PGSIZE/8];
+  uint64 i, n;
+  char *a;
+
+  if(memstat(&before) < 0){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  if(before.nswapfree < 1024){
+    printf("%s: not enough swap\n", s);
+    exit(1);
+  }
+  n = before.nfree + 512;
+  a = sbrk(n * PGSIZE);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++)
+    noisepage((uint64*)(a + i*PGSIZE), i);
+  for(i = 0; i < n; i++){
+    noisepage(want, i);
+    if(memcmp(a + i*PGSIZE, want, PGSIZE) != 0){
+      printf("%s: page %d lost\n", s, (int)i);
+      exit(1);
+    }
+  }
+  memstat(&after);
+  if(after.nswapout == before.nswapout || after.nswapin == before.nswapin ||
+     after.nswapin - after.nzramhit == before.nswapin - before.nzramhit){
+    printf("%s: no paging\n", s);
+    exit(1);
+  }
+  sbrk(-(n * PGSIZE));
+  memstat(&after);
+  if(after.nswapfree != before.nswapfree){
+    printf("%s: %d swap slots leaked\n", s,
+           (int)(before.nswapfree - after.nswapfree));
+    exit(1);
+  }
+}
+
+// the same with pages that compress well: they are kept in
+// memory, compressed, and faults find them there.
+void
+zramover(char *s)
+{
+  struct memstat before, during, after;
+  uint64 i, n;
+  char *a;
+
+  memstat(&before);
+  n = before.nfree + 512;
+  a = sbrk(n * PGSIZE);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++)
+    *(uint64*)(a + i*PGSIZE) = i;
+  memstat(&during);
+  for(i = 0; i < n; i++){
+    if(*(uint64*)(a + i*PGSIZE) != i){
+      printf("%s: page %d lost\n", s, (int)i);
+      exit(1);
+    }
+  }
+  memstat(&after);
+  if(during.nzram == before.nzram || after.nzramhit == before.nzramhit){
+    printf("%s: nothing compressed\n", s);
+    exit(1);
+  }
+  if(during.nzramalloc - before.nzramalloc >=
+     (during.nzram - before.nzram) * PGSIZE){
+    printf("%s: compressed pages take %d bytes\n", s,
+           (int)during.nzramalloc);
+    exit(1);
+  }
+  sbrk(-(n * PGSIZE));
+  memstat(&after);
+  if(after.nzram != before.nzram || after.nswapfree != before.nswapfree){
+    printf("%s: %d compressed pages leaked\n", s,
+           (int)(after.nzram - before.nzram));
+    exit(1);
+  }
+}
+
+#ifdef KTEST
+// several processes allocate and free buddy blocks of
+// mixed orders at once; the kernel checks alignment and
+// overlap, and that its free lists still agree with its
+// counts, both while they run and once they are done.
+void
+buddystress(char *s)
+{
+  enum { NCHILD = 4 };
+  int i, pid, xstatus;
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      if(buddytest(getpid(), 5000) < 0){
+        printf("%s: buddytest found a bad block\n", s);
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  if(buddytest(0, 0) < 0){
+    printf("%s: free lists inconsistent\n", s);
+    exit(1);
+  }
+}
+#endif
+
 // regression test. test whether exec() leaks memory if one of the
 // arguments is invalid. the test passes if the kernel doesn't panic.
 void
@@ -2635,6 +3150,19 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+#ifdef KTEST
+  {buddystress, "buddystress" },
+#endif
+  {cowpressure, "cowpressure" },
+  {cowchain, "cowchain" },
+  {sbrklazy, "sbrklazy" },
+  {zeropage, "zeropage" },
+  {spawntest, "spawntest" },
+  {vforktest, "vforktest" },
+  {execpaging, "execpaging" },
+  {sharedtext, "sharedtext" },
+  {swapover, "swapover" },
+  {zramover, "zramover" },
 
   { 0, 0},
 };
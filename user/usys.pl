@@ -37,4 +37,13 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("mmap");
-entry("munmap");
\ No newline at end of file
+entry("munmap");
+entry("memstat");
+entry("spawn");
+entry("vfork");
+entry("msync");
+entry("madvise");
+entry("mprotect");
+entry("mlock");
+entry("munlock");
+entry("buddytest");